@@ -0,0 +1,157 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Prerendered keyframe animations, played straight from a mmap'ed file.
+ * See animation.h for the file format.
+ *
+ * The whole file gets validated once when it is opened, so decoding the
+ * frames later on can't run past the end of the mapping.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "animation.h"
+
+/* decodes one value, the caller has made sure that it is complete */
+static inline uint16_t get_delta(const uint8_t **pos)
+{
+	uint32_t v = 0;
+	unsigned int shift = 0;
+
+	do {
+		v |= (uint32_t)(**pos & 0x7f) << shift;
+		shift += 7;
+	} while (*(*pos)++ & 0x80);
+
+	/* zigzag */
+	return (v >> 1) ^ -(v & 1);
+}
+
+/* checks that the stream holds exactly frames * channels valid varints */
+static int validate(const uint8_t *pos, const uint8_t *end, uint64_t values)
+{
+	unsigned int len;
+
+	for (; values; values--) {
+		for (len = 0; ; len++) {
+			/* 16-bit values need at most 3 bytes */
+			if (pos >= end || len >= 3)
+				return -EINVAL;
+			if (!(*pos++ & 0x80))
+				break;
+		}
+	}
+
+	return pos == end ? 0 : -EINVAL;
+}
+
+/**
+ * animation_open() - map and validate an animation file
+ * @anim:		The animation to set up.
+ * @path:		The file to play.
+ *
+ * Return:		On success return 0;
+ *			On failure return the errno.
+ */
+int animation_open(struct animation *anim, const char *path)
+{
+	const struct animation_header *hdr;
+	struct stat st;
+	void *map;
+	int fd, ret;
+
+	memset(anim, 0, sizeof(*anim));
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st)) {
+		ret = -errno;
+		goto out;
+	}
+
+	if ((size_t)st.st_size < sizeof(*hdr)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		ret = -errno;
+		goto out;
+	}
+
+	anim->map = map;
+	anim->size = st.st_size;
+
+	hdr = map;
+	anim->channels = hdr->channels;
+	anim->fps = le16toh(hdr->fps);
+	anim->frames = le32toh(hdr->frames);
+	anim->loop = !!(le32toh(hdr->flags) & ANIMATION_FLAG_LOOP);
+
+	if (memcmp(hdr->magic, ANIMATION_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != ANIMATION_VERSION ||
+	    anim->channels < 1 || anim->channels > 3 ||
+	    anim->fps < 1 || anim->fps > 1000 || !anim->frames ||
+	    validate(anim->map + sizeof(*hdr), anim->map + anim->size,
+		     (uint64_t)anim->frames * anim->channels)) {
+		animation_close(anim);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* the frames are read sequentially, once. */
+	madvise(map, anim->size, MADV_SEQUENTIAL);
+
+	animation_rewind(anim);
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+void animation_close(struct animation *anim)
+{
+	if (anim->map)
+		munmap((void *)anim->map, anim->size);
+
+	memset(anim, 0, sizeof(*anim));
+}
+
+void animation_rewind(struct animation *anim)
+{
+	anim->pos = anim->map + sizeof(struct animation_header);
+	anim->end = anim->map + anim->size;
+	anim->frame = 0;
+	memset(anim->value, 0, sizeof(anim->value));
+}
+
+/**
+ * animation_next() - decode the next frame into anim->value
+ * @anim:		The animation.
+ *
+ * Return:		false once the (non-looping) animation is over.
+ */
+bool animation_next(struct animation *anim)
+{
+	unsigned int i;
+
+	if (anim->frame >= anim->frames) {
+		if (!anim->loop)
+			return false;
+		animation_rewind(anim);
+	}
+
+	for (i = 0; i < anim->channels; i++)
+		anim->value[i] += get_delta(&anim->pos);
+
+	anim->frame++;
+	return true;
+}
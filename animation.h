@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Prerendered keyframe animations, played straight from a mmap'ed file.
+ *
+ * File format (all little-endian):
+ *
+ *	offset	size	field
+ *	0	4	magic "NUAN"
+ *	4	1	version (1)
+ *	5	1	channels (1-3, in red, green, blue order)
+ *	6	2	frames per second (1-1000)
+ *	8	4	number of frames
+ *	12	4	flags (bit 0: loop)
+ *	16	...	frame data
+ *
+ * The frame data is a stream of 16-bit values, channels per frame. Each
+ * value is stored as the difference to the same channel in the previous
+ * frame (starting from 0), modulo 65536, zigzag-encoded and written as a
+ * LEB128 varint. So slow fades take a single byte per channel and frame.
+ */
+#ifndef _ANIMATION_H_
+#define _ANIMATION_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ANIMATION_MAGIC		"NUAN"
+#define ANIMATION_VERSION	1
+#define ANIMATION_FLAG_LOOP	(1 << 0)
+
+struct animation_header {
+	char magic[4];
+	uint8_t version;
+	uint8_t channels;
+	uint16_t fps;
+	uint32_t frames;
+	uint32_t flags;
+} __attribute__((packed));
+
+struct animation {
+	const uint8_t *map;
+	size_t size;
+
+	const uint8_t *pos, *end;
+	unsigned int channels, fps, frames, frame;
+	bool loop;
+
+	/* red, green, blue of the current frame */
+	uint16_t value[3];
+};
+
+int animation_open(struct animation *anim, const char *path);
+void animation_close(struct animation *anim);
+void animation_rewind(struct animation *anim);
+bool animation_next(struct animation *anim);
+
+#endif /* _ANIMATION_H_ */
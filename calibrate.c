@@ -0,0 +1,491 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Finds the fastest clock timing a NU801 board can take.
+ *
+ * The NU801 is a shift register: whatever is clocked into SDI comes out
+ * of the cascade output (SDO) again 16 clocks per channel later. With
+ * SDO wired to a spare input GPIO, a random bit stream is shifted in and
+ * compared with what comes out, for a sweep of CKI high and low times.
+ * SDO is followed through the edge events of its line, so the levels are
+ * known for the exact times the chip sampled them.
+ *
+ * The pulse widths are meant like in supported_hardware[]: the time the
+ * line stays put, including the GPIO ioctl that changes it next. Widths
+ * below what an ioctl takes on the machine it runs on can't be tested.
+ *
+ * gcc -D_GNU_SOURCE -Os -o nu801-calibrate -std=gnu11 gpio-utils.c \
+ *     calibrate.c
+ *
+ * The LED shows random colors while this runs, it is turned off at the
+ * end.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+
+#include <linux/gpio.h>
+
+#include "gpio-utils.h"
+#include "sdo.h"
+
+enum {
+	CKI = 0,
+	SDI,
+	LEI,
+};
+
+static const unsigned int widths[] = {
+	0, 50, 100, 150, 200, 300, 400, 500, 750, 1000, 1500, 2000, 3000,
+	5000, 10000,
+};
+
+static struct gpio_v2_line_values values;
+static int out_fd = -1, sdo_fd = -1;
+static uint64_t ioctl_floor_ns;
+static int gpio_error;	/* the first failed ioctl */
+static unsigned int bits;	/* of the shift register, 16 per channel */
+static unsigned int rounds = 32;
+static uint64_t seed = 0x9e3779b97f4a7c15ULL;
+
+/* the stream that was sent and the SDO levels before each rising edge */
+static uint8_t *sent, *seen;
+static uint64_t *sampled;
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static unsigned int random_bit(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return seed & 1;
+}
+
+/* like in the daemon: the floor follows faster ioctls right away */
+static void commit(void)
+{
+	uint64_t start = monotonic_ns(), t;
+	int ret;
+
+	ret = gpiotools_set_values(out_fd, &values);
+	if (ret < 0 && !gpio_error)
+		gpio_error = ret;
+
+	t = monotonic_ns() - start;
+	if (t < ioctl_floor_ns || !ioctl_floor_ns)
+		ioctl_floor_ns = t;
+	else
+		ioctl_floor_ns += (t - ioctl_floor_ns) >> 8;
+}
+
+/* like the daemon's pulse_wait(), the short waits are spun */
+static void pulse(unsigned int ns)
+{
+	uint64_t start = monotonic_ns();
+
+	if (ns <= ioctl_floor_ns)
+		return;
+
+	ns -= ioctl_floor_ns;
+	while (monotonic_ns() - start < ns)
+		;
+}
+
+static int sdo_level(void)
+{
+	struct gpio_v2_line_values v = { .mask = 1 };
+
+	if (gpiotools_get_values(sdo_fd, &v) < 0)
+		return -1;
+
+	return v.bits & 1;
+}
+
+/* throws away the edges from before */
+static void drain_events(void)
+{
+	struct gpio_v2_line_event ev[16];
+	struct pollfd pfd = { .fd = sdo_fd, .events = POLLIN };
+
+	while (poll(&pfd, 1, 0) > 0 && read(sdo_fd, ev, sizeof(ev)) > 0)
+		;
+}
+
+/* how far the SDO edges have been replayed onto the sampling points */
+static struct {
+	unsigned int samples;	/* seen[] is known up to here */
+	int level;
+	uint32_t seqno;
+	bool lost;		/* the kernel's event buffer overflowed */
+} replay;
+
+/*
+ * replays the SDO edges that came in so far to get its level at each
+ * sampling point before them. The samples after the last edge are only
+ * known once there aren't any edges to come, see replay_finish().
+ */
+static int replay_edges(unsigned int n, int timeout)
+{
+	struct gpio_v2_line_event ev[16];
+	struct pollfd pfd = { .fd = sdo_fd, .events = POLLIN };
+	unsigned int i = replay.samples, j;
+	ssize_t len;
+
+	while (poll(&pfd, 1, timeout) > 0) {
+		len = read(sdo_fd, ev, sizeof(ev));
+		if (len < 0)
+			return -errno;
+
+		for (j = 0; j < len / sizeof(ev[0]); j++) {
+			if (replay.seqno && ev[j].line_seqno != replay.seqno + 1)
+				replay.lost = true;
+			replay.seqno = ev[j].line_seqno;
+
+			for (; i < n && sampled[i] < ev[j].timestamp_ns; i++)
+				seen[i] = replay.level;
+			replay.level = ev[j].id == GPIO_V2_LINE_EVENT_RISING_EDGE;
+		}
+	}
+
+	replay.samples = i;
+	return 0;
+}
+
+static int replay_finish(unsigned int n)
+{
+	int ret;
+
+	ret = replay_edges(n, 10);
+	if (ret)
+		return ret;
+
+	if (replay.lost)
+		return -EOVERFLOW;
+
+	for (; replay.samples < n; replay.samples++)
+		seen[replay.samples] = replay.level;
+
+	return 0;
+}
+
+/*
+ * shifts n bits in, notes when each rising edge was about to happen.
+ * The kernel only buffers 16 edges, so they are picked up every 8 bits.
+ */
+static int shift(unsigned int n, unsigned int high, unsigned int low)
+{
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < n; i++) {
+		gpiotools_assign_bit(&values.bits, SDI, sent[i]);
+		gpiotools_assign_bit(&values.bits, CKI, 0);
+		commit();
+		if (!(i & 7) && sdo_fd >= 0) {
+			ret = replay_edges(i, 0);
+			if (ret)
+				return ret;
+		}
+		pulse(low);
+
+		sampled[i] = monotonic_ns();
+		gpiotools_assign_bit(&values.bits, CKI, 1);
+		commit();
+		pulse(high);
+	}
+
+	gpiotools_assign_bit(&values.bits, CKI, 0);
+	commit();
+	return 0;
+}
+
+/*
+ * runs the stream at the given widths, returns the number of bits that
+ * didn't come out of SDO like they went in (see sdo.h for the offset).
+ */
+static int run(unsigned int high, unsigned int low, int offset)
+{
+	unsigned int n = bits * (rounds + 1), i, errors = 0;
+	int ret;
+
+	for (i = 0; i < n; i++)
+		sent[i] = random_bit();
+
+	drain_events();
+	memset(&replay, 0, sizeof(replay));
+	replay.level = sdo_level();
+	if (replay.level < 0)
+		return -EIO;
+
+	ret = shift(n, high, low);
+	if (!ret)
+		ret = gpio_error;
+	if (!ret)
+		ret = replay_finish(n);
+	if (ret)
+		return ret;
+
+	/* the first pass just fills the register */
+	for (i = bits; i < n; i += bits)
+		errors += sdo_mismatches(sent + i - bits, seen + i, bits,
+					 offset);
+
+	return errors;
+}
+
+/* clocks zeros in and latches them, so the LED is off afterwards */
+static void led_off(bool lei)
+{
+	memset(sent, 0, bits);
+	(void)shift(bits, 1000, 1000);
+
+	if (lei) {
+		gpiotools_assign_bit(&values.bits, LEI, 1);
+		commit();
+		pulse(1000);
+		gpiotools_assign_bit(&values.bits, LEI, 0);
+		commit();
+	} else {
+		/* the pseudo latch after 600us of CKI high */
+		gpiotools_assign_bit(&values.bits, CKI, 1);
+		commit();
+		usleep(1000);
+		gpiotools_assign_bit(&values.bits, CKI, 0);
+		commit();
+	}
+}
+
+enum {
+	SWEEP_HIGH = 1,
+	SWEEP_LOW = 2,
+};
+
+static const char *const sweep_names[] = { "", "cki_high", "cki_low", "cki" };
+
+/*
+ * finds the smallest width from which on all the wider ones pass. Returns
+ * how many of them did (0 = not even the slowest) or the errno.
+ */
+static int sweep(unsigned int which, unsigned int *high, unsigned int *low,
+		 int offset, unsigned int *best)
+{
+	int i, ret, passed = 0;
+
+	for (i = ARRAY_SIZE(widths) - 1; i >= 0; i--) {
+		if (which & SWEEP_HIGH)
+			*high = widths[i];
+		if (which & SWEEP_LOW)
+			*low = widths[i];
+
+		ret = run(*high, *low, offset);
+		if (ret < 0)
+			return ret;
+
+		printf("%-8s %5u ns: %s (%d bit errors)\n", sweep_names[which],
+		       widths[i], ret ? "FAIL" : "ok", ret);
+		if (ret)
+			break;
+		*best = widths[i];
+		passed++;
+	}
+
+	return passed;
+}
+
+/* what the daemon should get: the width with a margin of 50% */
+static unsigned int margin(unsigned int ns)
+{
+	if (ns < ioctl_floor_ns)
+		ns = ioctl_floor_ns;
+
+	return (ns * 3 / 2 + 9) / 10 * 10;
+}
+
+static void __attribute__ ((noreturn)) usage(int ret)
+{
+	fprintf(stderr, "Usage: nu801-calibrate [-c gpiochip] -k cki -s sdi -o sdo [-l lei] [-n channels] [-r rounds] [-f file] [-h] [board]\n\n"
+		"Finds the fastest CKI timing by reading the data back through\n"
+		"the NU801's cascade output (SDO) wired to an input GPIO.\n\n"
+		"\t-c\t- the gpiochip (default: gpiochip0).\n"
+		"\t-k\t- the CKI line.\n"
+		"\t-s\t- the SDI line.\n"
+		"\t-o\t- the line that SDO is connected to.\n"
+		"\t-l\t- the LEI line, if there is one.\n"
+		"\t-n\t- the number of channels (default: 3).\n"
+		"\t-r\t- register fills per width (default: 32).\n"
+		"\t-f\t- write the profile to file instead of stdout.\n"
+		"\t-h\t- shows this help.\n");
+	exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+int main(int argc, char **argv)
+{
+	struct gpio_v2_line_config config = { 0 };
+	const char *chip = "gpiochip0", *profile = NULL, *board = "board";
+	unsigned int lines[3], sdo = ~0, channels = 3, high, low, i;
+	unsigned int best, best_high, best_low;
+	int opt, ret = -EINVAL, offset;
+	bool lei = false;
+	FILE *out;
+
+	lines[CKI] = lines[SDI] = ~0;
+	while ((opt = getopt(argc, argv, "c:k:s:o:l:n:r:f:h")) != -1) {
+		switch (opt) {
+		case 'c':
+			chip = optarg;
+			break;
+		case 'k':
+			lines[CKI] = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			lines[SDI] = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			sdo = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			lines[LEI] = strtoul(optarg, NULL, 0);
+			lei = true;
+			break;
+		case 'n':
+			channels = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			rounds = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			profile = optarg;
+			break;
+		case 'h':
+			usage(0);
+			break;
+		default:
+			usage(ret);
+			break;
+		}
+	}
+
+	if (lines[CKI] == ~0U || lines[SDI] == ~0U || sdo == ~0U ||
+	    !channels || channels > 3 || !rounds || rounds > 4096)
+		usage(ret);
+
+	if (optind < argc)
+		board = argv[optind];
+
+	bits = channels * 16;
+	sent = calloc(bits * (rounds + 1), 1);
+	seen = calloc(bits * (rounds + 1), 1);
+	sampled = calloc(bits * (rounds + 1), sizeof(*sampled));
+	if (!sent || !seen || !sampled) {
+		perror("nu801-calibrate");
+		return EXIT_FAILURE;
+	}
+	seed ^= monotonic_ns();
+
+	config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+	out_fd = gpiotools_request_line(chip, lines, lei ? 3 : 2, &config,
+					"nu801-calibrate");
+	if (out_fd < 0)
+		return EXIT_FAILURE;
+
+	for (i = 0; i < (lei ? 3 : 2); i++)
+		gpiotools_set_bit(&values.mask, i);
+
+	config.flags = GPIO_V2_LINE_FLAG_INPUT |
+		       GPIO_V2_LINE_FLAG_EDGE_RISING |
+		       GPIO_V2_LINE_FLAG_EDGE_FALLING;
+	sdo_fd = gpiotools_request_line(chip, &sdo, 1, &config,
+					"nu801-calibrate");
+	if (sdo_fd < 0) {
+		ret = sdo_fd;
+		goto out;
+	}
+
+	/* the ioctl's time, the lines don't change yet */
+	for (i = 0; i < 64; i++)
+		commit();
+	printf("GPIO ioctl takes at least %llu ns\n",
+	       (unsigned long long)ioctl_floor_ns);
+
+	/*
+	 * where SDO is sampled relative to the edge isn't the same for all
+	 * wirings, so find out at the slowest width first.
+	 */
+	for (offset = SDO_OFFSET_MIN; offset <= SDO_OFFSET_MAX; offset++) {
+		ret = run(10000, 10000, offset);
+		if (ret <= 0)
+			break;
+	}
+
+	if (ret < 0) {
+		fprintf(stderr, "nu801-calibrate: %s\n", strerror(-ret));
+		goto out;
+	} else if (ret) {
+		fprintf(stderr, "nu801-calibrate: SDO doesn't follow SDI even at 10us, check the wiring\n");
+		ret = -EIO;
+		goto out;
+	}
+
+	/* both at once, then each of them with the other one at its best */
+	high = low = 0;
+	ret = sweep(SWEEP_HIGH | SWEEP_LOW, &high, &low, offset, &best);
+	if (ret <= 0)
+		goto fail;
+
+	high = low = best;
+	ret = sweep(SWEEP_HIGH, &high, &low, offset, &best_high);
+	if (ret <= 0)
+		goto fail;
+
+	high = best;
+	ret = sweep(SWEEP_LOW, &high, &low, offset, &best_low);
+	if (ret <= 0)
+		goto fail;
+
+	out = profile ? fopen(profile, "w") : stdout;
+	if (!out) {
+		perror(profile);
+		ret = -errno;
+		goto out;
+	}
+
+	/* LEI can't be read back, it gets the slower one of the two */
+	fprintf(out, "/* %s: verified with %u x %u bits, GPIO ioctl %llu ns */\n",
+		board, rounds, bits, (unsigned long long)ioctl_floor_ns);
+	fprintf(out, ".pulse = { .cki_high = %u, .cki_low = %u, .lei = %u },\n",
+		margin(best_high), margin(best_low),
+		margin(best_high > best_low ? best_high : best_low));
+	fprintf(out, "/* SDO offset %d, verify frames with -V %u:%d */\n",
+		offset, sdo, offset);
+	if (out != stdout)
+		fclose(out);
+
+	ret = 0;
+	goto out;
+
+fail:
+	fprintf(stderr, "nu801-calibrate: %s\n", ret < 0 ?
+		strerror(-ret) : "even the slowest timing failed");
+	ret = -EIO;
+out:
+	/* the lines are ours, whatever happened */
+	led_off(lei);
+	if (sdo_fd >= 0)
+		gpiotools_release_line(sdo_fd);
+	gpiotools_release_line(out_fd);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,141 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Built-in LED effects for the NU801 userspace controller.
+ *
+ * Everything in here is integer math, the daemon runs on MIPS boxes
+ * without a FPU. Intensities are Q16 (65536 = 1.0) as well.
+ */
+
+#include <string.h>
+#include "effects.h"
+
+/* scales a brightness by a Q16 intensity */
+static inline int scale(int brightness, uint32_t intensity)
+{
+	return ((uint32_t)brightness * intensity) >> 16;
+}
+
+/* 0 -> 1 -> 0 over one period */
+static inline uint32_t triangle(uint32_t phase)
+{
+	return phase < EFFECT_PHASE_ONE / 2 ?
+		phase * 2 : (EFFECT_PHASE_ONE - phase) * 2;
+}
+
+/* 3x^2 - 2x^3, a cheap stand-in for a sine half-wave */
+static inline uint32_t smoothstep(uint32_t x)
+{
+	uint64_t x2 = ((uint64_t)x * x) >> 16;
+
+	return (x2 * (3 * EFFECT_PHASE_ONE - 2 * (uint64_t)x)) >> 16;
+}
+
+/* 1 -> 0 with a quadratic decay over len, starting at start */
+static uint32_t decay(uint32_t phase, uint32_t start, uint32_t len)
+{
+	uint64_t x;
+
+	if (phase < start || phase >= start + len)
+		return 0;
+
+	x = ((uint64_t)(start + len - phase) << 16) / len;
+	return (x * x) >> 16;
+}
+
+static void effect_breathe(uint32_t phase, const int *base, int *out,
+			   unsigned int num, int max)
+{
+	uint32_t intensity = smoothstep(triangle(phase));
+	unsigned int i;
+
+	(void)max;
+	for (i = 0; i < num; i++)
+		out[i] = scale(base[i], intensity);
+}
+
+static void effect_blink(uint32_t phase, const int *base, int *out,
+			 unsigned int num, int max)
+{
+	unsigned int i;
+
+	(void)max;
+	for (i = 0; i < num; i++)
+		out[i] = phase < EFFECT_PHASE_ONE / 2 ? base[i] : 0;
+}
+
+static void effect_pulse(uint32_t phase, const int *base, int *out,
+			 unsigned int num, int max)
+{
+	uint32_t intensity = decay(phase, 0, EFFECT_PHASE_ONE);
+	unsigned int i;
+
+	(void)max;
+	for (i = 0; i < num; i++)
+		out[i] = scale(base[i], intensity);
+}
+
+static void effect_heartbeat(uint32_t phase, const int *base, int *out,
+			     unsigned int num, int max)
+{
+	/* a strong and a weaker beat, followed by a pause */
+	uint32_t intensity = decay(phase, 0, EFFECT_PHASE_ONE / 8) +
+		((decay(phase, EFFECT_PHASE_ONE / 4, EFFECT_PHASE_ONE / 8) *
+		  3) >> 2);
+	unsigned int i;
+
+	(void)max;
+	for (i = 0; i < num; i++)
+		out[i] = scale(base[i], intensity);
+}
+
+/*
+ * Walks around the hue circle. Each channel gets the same trapezoid
+ * shifted by a third of the period, so this works for any channel
+ * order - only the direction changes.
+ */
+static void effect_rainbow(uint32_t phase, const int *base, int *out,
+			   unsigned int num, int max)
+{
+	uint32_t hue, x;
+	unsigned int i;
+
+	(void)base;
+	for (i = 0; i < num; i++) {
+		hue = (phase + i * (EFFECT_PHASE_ONE / 3)) % EFFECT_PHASE_ONE;
+
+		/* |6h - 3| - 1, clamped to 0..1 */
+		x = hue * 6;
+		x = x > 3 * EFFECT_PHASE_ONE ?
+			x - 3 * EFFECT_PHASE_ONE : 3 * EFFECT_PHASE_ONE - x;
+		if (x <= EFFECT_PHASE_ONE)
+			x = 0;
+		else if (x >= 2 * EFFECT_PHASE_ONE)
+			x = EFFECT_PHASE_ONE;
+		else
+			x -= EFFECT_PHASE_ONE;
+
+		out[i] = scale(max, x);
+	}
+}
+
+const struct effect effects[] = {
+	{ .name = "breathe", .period_ms = 4000, .render = effect_breathe },
+	{ .name = "blink", .period_ms = 1000, .render = effect_blink },
+	{ .name = "pulse", .period_ms = 1000, .render = effect_pulse },
+	{ .name = "rainbow", .period_ms = 6000, .render = effect_rainbow },
+	{ .name = "heartbeat", .period_ms = 1200, .render = effect_heartbeat },
+};
+
+const unsigned int num_effects = sizeof(effects) / sizeof(effects[0]);
+
+const struct effect *effect_find(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_effects; i++) {
+		if (!strcmp(effects[i].name, name))
+			return &effects[i];
+	}
+
+	return NULL;
+}
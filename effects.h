@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Built-in LED effects for the NU801 userspace controller.
+ *
+ * All effects are pure fixed-point functions of the phase within their
+ * period. They take the current brightness of the channels as base color
+ * and produce the brightness that gets sent with the next frame.
+ */
+#ifndef _EFFECTS_H_
+#define _EFFECTS_H_
+
+#include <stdint.h>
+
+/* phase within the effect's period, Q16: 0 .. 65535 */
+#define EFFECT_PHASE_ONE 65536
+
+struct effect {
+	const char *name;
+	unsigned int period_ms;
+
+	void (*render)(uint32_t phase, const int *base, int *out,
+		       unsigned int num, int max);
+};
+
+extern const struct effect effects[];
+extern const unsigned int num_effects;
+
+const struct effect *effect_find(const char *name);
+
+#endif /* _EFFECTS_H_ */
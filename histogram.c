@@ -0,0 +1,90 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Log-linear latency histograms, the parts that are not on the hot path.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include "histogram.h"
+
+/* the smallest value that ends up in bucket idx */
+static uint64_t bucket_lower(unsigned int idx)
+{
+	unsigned int e, m;
+
+	if (idx < (1 << HISTOGRAM_SUB_BITS))
+		return idx;
+
+	e = (idx >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+	m = idx & ((1 << HISTOGRAM_SUB_BITS) - 1);
+	return (uint64_t)((1 << HISTOGRAM_SUB_BITS) + m) <<
+	       (e - HISTOGRAM_SUB_BITS);
+}
+
+/**
+ * histogram_percentile() - estimate a percentile
+ * @h:			The histogram.
+ * @permille:		The percentile in 1/1000, i.e. 999 for p99.9.
+ *
+ * Return:		The upper bound of the bucket the percentile falls
+ *			into, but never more than the largest value seen.
+ */
+uint64_t histogram_percentile(const struct histogram *h,
+			      unsigned int permille)
+{
+	uint64_t rank, seen = 0, upper;
+	unsigned int i;
+
+	if (!h->count)
+		return 0;
+
+	rank = (h->count * permille + 999) / 1000;
+	for (i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+
+	upper = i < HISTOGRAM_BUCKETS - 1 ? bucket_lower(i + 1) - 1 : h->max;
+	return upper < h->max ? upper : h->max;
+}
+
+/**
+ * histogram_format() - print a histogram
+ * @h:			The histogram.
+ * @buf:		Where to print it.
+ * @size:		The size of buf.
+ * @buckets:		Also print every bucket that isn't empty.
+ *
+ * Return:		On success return the length;
+ *			On failure return -ENOSPC.
+ */
+int histogram_format(const struct histogram *h, char *buf, size_t size,
+		     bool buckets)
+{
+	unsigned int i;
+	int len;
+
+	len = snprintf(buf, size,
+		       "%s count %llu min %llu p50 %llu p90 %llu p99 %llu "
+		       "p999 %llu max %llu mean %llu\n", h->name,
+		       (unsigned long long)h->count,
+		       (unsigned long long)(h->count ? h->min : 0),
+		       (unsigned long long)histogram_percentile(h, 500),
+		       (unsigned long long)histogram_percentile(h, 900),
+		       (unsigned long long)histogram_percentile(h, 990),
+		       (unsigned long long)histogram_percentile(h, 999),
+		       (unsigned long long)h->max,
+		       (unsigned long long)(h->count ? h->sum / h->count : 0));
+
+	for (i = 0; buckets && i < HISTOGRAM_BUCKETS && len < (int)size; i++) {
+		if (!h->buckets[i])
+			continue;
+
+		len += snprintf(buf + len, size - len, "  >= %llu: %llu\n",
+				(unsigned long long)bucket_lower(i),
+				(unsigned long long)h->buckets[i]);
+	}
+
+	return len < (int)size ? len : -ENOSPC;
+}
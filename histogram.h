@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Log-linear latency histograms.
+ *
+ * Every power of two is split into 8 linear buckets, so any value is
+ * within 12.5% of its bucket's bounds. The buckets are part of the
+ * struct and adding a value is a few instructions, it can be done right
+ * in the middle of sending a frame.
+ */
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HISTOGRAM_SUB_BITS	3
+#define HISTOGRAM_MAX_EXP	39	/* 2^40 ns, that's about 18 minutes */
+#define HISTOGRAM_BUCKETS	\
+	((HISTOGRAM_MAX_EXP - HISTOGRAM_SUB_BITS + 2) << HISTOGRAM_SUB_BITS)
+
+struct histogram {
+	const char *name;
+	uint64_t count, sum, min, max;	/* ns */
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+static inline unsigned int histogram_bucket(uint64_t v)
+{
+	unsigned int e;
+
+	if (v < (1 << HISTOGRAM_SUB_BITS))
+		return v;
+
+	e = 63 - __builtin_clzll(v);
+	if (e > HISTOGRAM_MAX_EXP)
+		return HISTOGRAM_BUCKETS - 1;
+
+	return ((e - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) +
+	       ((v >> (e - HISTOGRAM_SUB_BITS)) &
+		((1 << HISTOGRAM_SUB_BITS) - 1));
+}
+
+static inline void histogram_add(struct histogram *h, uint64_t v)
+{
+	h->buckets[histogram_bucket(v)]++;
+	if (!h->count++ || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->sum += v;
+}
+
+uint64_t histogram_percentile(const struct histogram *h,
+			      unsigned int permille);
+int histogram_format(const struct histogram *h, char *buf, size_t size,
+		     bool buckets);
+
+#endif /* _HISTOGRAM_H_ */
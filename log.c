@@ -0,0 +1,256 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Asynchronous debug log, see log.h.
+ *
+ * The ring has a single producer (the event loop) and a single consumer
+ * (the writer thread), so the head and the tail are all that needs to be
+ * atomic. The producer never waits, it drops the record instead.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "log.h"
+
+struct log_record {
+	const char *fmt;
+	uint64_t ns;		/* CLOCK_MONOTONIC */
+	uint64_t dropped;	/* records lost right before this one */
+	char types[LOG_MAX_ARGS];
+	union {
+		uint64_t u;	/* or the offset of a string in str */
+		double f;
+	} args[LOG_MAX_ARGS];
+	char str[LOG_STR_SPACE];
+};
+
+bool log_enabled;
+uint64_t log_dropped;
+
+static struct log_record ring[LOG_RECORDS];
+static _Atomic uint64_t head, tail;
+static uint64_t pending_drops;
+
+static pthread_t writer;
+static bool writer_running;
+static atomic_bool writer_stop;
+
+void log_write(const char *fmt, const char *types, ...)
+{
+	uint64_t h = atomic_load_explicit(&head, memory_order_relaxed);
+	struct log_record *r;
+	struct timespec now;
+	unsigned int i, str = 0;
+	const char *s;
+	size_t len;
+	va_list ap;
+
+	if (h - atomic_load_explicit(&tail, memory_order_acquire) >= LOG_RECORDS) {
+		log_dropped++;
+		pending_drops++;
+		return;
+	}
+
+	r = &ring[h & (LOG_RECORDS - 1)];
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	r->fmt = fmt;
+	r->ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	r->dropped = pending_drops;
+	pending_drops = 0;
+
+	va_start(ap, types);
+	for (i = 0; i < LOG_MAX_ARGS; i++) {
+		r->types[i] = types[i];
+
+		switch (types[i]) {
+		case 's':
+			/* the strings may well be gone by the time it's printed */
+			s = va_arg(ap, const char *);
+			if (!s)
+				s = "(null)";
+			len = strnlen(s, sizeof(r->str) - 1 - str);
+			memcpy(r->str + str, s, len);
+			r->str[str + len] = '\0';
+			r->args[i].u = str;
+			str += len + (str + len < sizeof(r->str) - 1);
+			break;
+		case 'f':
+			r->args[i].f = va_arg(ap, double);
+			break;
+		case 'L':
+			r->args[i].u = va_arg(ap, unsigned long long);
+			break;
+		case 'i':
+			r->args[i].u = (int64_t)va_arg(ap, int);
+			break;
+		default:
+			i = LOG_MAX_ARGS;
+			break;
+		}
+	}
+	va_end(ap);
+
+	atomic_store_explicit(&head, h + 1, memory_order_release);
+}
+
+/* printf() with the arguments from the record */
+static void log_format(const struct log_record *r, char *out, size_t size)
+{
+	const char *f = r->fmt;
+	unsigned int arg = 0, n;
+	char spec[24], conv, type;
+	size_t len = 0;
+	int ret;
+
+	while (*f && len < size - 1) {
+		if (*f != '%' || f[1] == '%') {
+			out[len++] = *f;
+			f += 1 + (*f == '%');
+			continue;
+		}
+
+		/* the flags, width and precision stay, the length is ours */
+		for (n = 0; *f && n < sizeof(spec) - 4; f++) {
+			if (n && !strchr("-+ #0123456789.", *f))
+				break;
+			spec[n++] = *f;
+		}
+		while (*f && strchr("hlLjzt", *f))
+			f++;
+
+		if (!*f || arg >= LOG_MAX_ARGS)
+			break;
+
+		conv = *f++;
+		type = r->types[arg];
+		spec[n] = '\0';
+
+		if (strchr("di", conv) && (type == 'i' || type == 'L')) {
+			strcat(spec, "lld");
+			ret = snprintf(out + len, size - len, spec, type == 'L' ?
+				       (long long)r->args[arg].u :
+				       (long long)(int)r->args[arg].u);
+		} else if (strchr("uxXo", conv) && (type == 'i' || type == 'L')) {
+			spec[n] = 'l';
+			spec[n + 1] = 'l';
+			spec[n + 2] = conv;
+			spec[n + 3] = '\0';
+			ret = snprintf(out + len, size - len, spec, type == 'L' ?
+				       (unsigned long long)r->args[arg].u :
+				       (unsigned long long)(unsigned int)r->args[arg].u);
+		} else if (conv == 'c' && type == 'i') {
+			strcat(spec, "c");
+			ret = snprintf(out + len, size - len, spec,
+				       (int)r->args[arg].u);
+		} else if (strchr("feEgGaA", conv) && type == 'f') {
+			spec[n] = conv;
+			spec[n + 1] = '\0';
+			ret = snprintf(out + len, size - len, spec,
+				       r->args[arg].f);
+		} else if (conv == 's' && type == 's') {
+			strcat(spec, "s");
+			ret = snprintf(out + len, size - len, spec,
+				       r->str + r->args[arg].u);
+		} else {
+			ret = snprintf(out + len, size - len, "?");
+		}
+
+		arg++;
+		if (ret > 0)
+			len += ret;
+	}
+
+	if (len > size - 1)
+		len = size - 1;
+	out[len] = '\0';
+}
+
+/* prints everything that's in the ring, returns true if there was any */
+static bool log_drain(void)
+{
+	uint64_t t = atomic_load_explicit(&tail, memory_order_relaxed);
+	uint64_t h = atomic_load_explicit(&head, memory_order_acquire);
+	const struct log_record *r;
+	char buf[512];
+
+	if (t == h)
+		return false;
+
+	for (; t != h; t++) {
+		r = &ring[t & (LOG_RECORDS - 1)];
+		if (r->dropped)
+			printf("(%llu log records dropped)\n",
+			       (unsigned long long)r->dropped);
+
+		log_format(r, buf, sizeof(buf));
+		printf("[%5llu.%06llu] %s",
+		       (unsigned long long)(r->ns / 1000000000ULL),
+		       (unsigned long long)(r->ns % 1000000000ULL / 1000),
+		       buf);
+
+		atomic_store_explicit(&tail, t + 1, memory_order_release);
+	}
+
+	fflush(stdout);
+	return true;
+}
+
+static void *log_writer(void *arg)
+{
+	struct timespec nap = { 0, 10000000 };
+	struct sched_param param = { 0 };
+
+	(void)arg;
+
+	/* only run when nothing else wants to */
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+	while (!atomic_load(&writer_stop)) {
+		if (!log_drain())
+			nanosleep(&nap, NULL);
+	}
+
+	log_drain();
+	return NULL;
+}
+
+/**
+ * log_start() - start the writer thread
+ *
+ * Threads don't survive a fork(), so this has to be done by the daemon.
+ * Until then, the records just stay in the ring.
+ *
+ * Return:		On success return 0;
+ *			On failure return the errno.
+ */
+int log_start(void)
+{
+	int ret;
+
+	if (!log_enabled || writer_running)
+		return 0;
+
+	ret = pthread_create(&writer, NULL, log_writer, NULL);
+	if (ret)
+		return -ret;
+
+	writer_running = true;
+	return 0;
+}
+
+/* prints what's left and stops the writer thread */
+void log_stop(void)
+{
+	if (writer_running) {
+		atomic_store(&writer_stop, true);
+		pthread_join(writer, NULL);
+		writer_running = false;
+	}
+
+	log_drain();
+}
@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Asynchronous debug log.
+ *
+ * printf() from the event loop distorts the very timing that's being
+ * debugged and a slow console stalls the bit-bang. So the loop only
+ * stores a binary record (the format string's address, the arguments
+ * and a timestamp) into a lock-free ring, a writer thread with the
+ * lowest priority formats and prints them later. If the ring is full,
+ * records are dropped and counted.
+ *
+ * The levels are chosen at compile time (-DNU801_LOG_LEVEL=...), the
+ * messages above it are gone entirely. Strings are copied into the
+ * record (up to LOG_STR_SPACE bytes for all of them), everything else
+ * is stored by value. There can be up to LOG_MAX_ARGS arguments.
+ */
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LOG_LEVEL_NONE		0
+#define LOG_LEVEL_DEBUG		1	/* setup and state changes */
+#define LOG_LEVEL_TRACE		2	/* every event and frame */
+
+#ifndef NU801_LOG_LEVEL
+#define NU801_LOG_LEVEL		LOG_LEVEL_TRACE
+#endif
+
+#define LOG_MAX_ARGS		6
+#define LOG_STR_SPACE		48
+#define LOG_RECORDS		1024	/* a power of 2 */
+
+extern bool log_enabled;
+extern uint64_t log_dropped;
+
+/* 's' string, 'f' double, 'L' 64-bit integer, 'i' int (or smaller) */
+#define _LOG_TYPE(x) _Generic((x),					\
+	char *: 's', const char *: 's',					\
+	float: 'f', double: 'f',					\
+	default: sizeof(x) > sizeof(int) ? 'L' : 'i')
+
+#define _LOG_NARGS(...) _LOG_NARGS_(, ##__VA_ARGS__, 6, 5, 4, 3, 2, 1, 0)
+#define _LOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, n, ...) n
+
+#define _LOG_MAP0(m)
+#define _LOG_MAP1(m, a) m(a),
+#define _LOG_MAP2(m, a, ...) m(a), _LOG_MAP1(m, __VA_ARGS__)
+#define _LOG_MAP3(m, a, ...) m(a), _LOG_MAP2(m, __VA_ARGS__)
+#define _LOG_MAP4(m, a, ...) m(a), _LOG_MAP3(m, __VA_ARGS__)
+#define _LOG_MAP5(m, a, ...) m(a), _LOG_MAP4(m, __VA_ARGS__)
+#define _LOG_MAP6(m, a, ...) m(a), _LOG_MAP5(m, __VA_ARGS__)
+#define _LOG_CAT(a, b) _LOG_CAT_(a, b)
+#define _LOG_CAT_(a, b) a##b
+#define _LOG_MAP(m, ...) \
+	_LOG_CAT(_LOG_MAP, _LOG_NARGS(__VA_ARGS__))(m, ##__VA_ARGS__)
+
+#define LOG(level, fmt, ...)						\
+	do {								\
+		if (NU801_LOG_LEVEL >= (level) && log_enabled)		\
+			log_write(fmt, (const char []) {		\
+				_LOG_MAP(_LOG_TYPE, ##__VA_ARGS__) 0	\
+			}, ##__VA_ARGS__);				\
+	} while (0)
+
+void log_write(const char *fmt, const char *types, ...)
+	__attribute__((format(printf, 1, 3)));
+
+int log_start(void);
+void log_stop(void);
+
+#endif /* _LOG_H_ */
@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Plugin interface for custom effect generators of the NU801 userspace
+ * controller.
+ *
+ * A plugin is a shared object that exports nu801_plugin_init(). The
+ * daemon loads it with -x, after that it can be selected like any of the
+ * built-in effects (by name through the control socket or by index via
+ * the effect LED).
+ *
+ *	static void render(uint64_t t, int *channels, unsigned int num)
+ *	{
+ *		...
+ *	}
+ *
+ *	static const struct nu801_plugin gauge = {
+ *		.abi = NU801_PLUGIN_ABI,
+ *		.name = "gauge",
+ *		.render = render,
+ *	};
+ *
+ *	const struct nu801_plugin *nu801_plugin_init(void)
+ *	{
+ *		return &gauge;
+ *	}
+ *
+ * gcc -shared -fPIC -o gauge.so gauge.c
+ */
+#ifndef _NU801_PLUGIN_H_
+#define _NU801_PLUGIN_H_
+
+#include <stdint.h>
+
+#define NU801_PLUGIN_ABI	1
+#define NU801_PLUGIN_INIT	"nu801_plugin_init"
+
+struct nu801_plugin {
+	unsigned int abi;	/* NU801_PLUGIN_ABI */
+	const char *name;
+
+	/*
+	 * optional, called once after loading. colors holds the color of
+	 * each channel ("red", "green", ...), max is the highest brightness.
+	 * Returns 0 or a negative errno.
+	 */
+	int (*setup)(const char *const *colors, unsigned int num, int max);
+
+	/*
+	 * called for every frame while the plugin is the running effect.
+	 * t is the wall clock time in ns. channels holds the brightness of
+	 * the channels' LEDs on entry and the brightness to show on return.
+	 * This has to finish within the daemon's time budget, or the plugin
+	 * gets disabled.
+	 */
+	void (*render)(uint64_t t, int *channels, unsigned int num);
+
+	/* optional, called before the plugin is unloaded */
+	void (*teardown)(void);
+};
+
+typedef const struct nu801_plugin *(*nu801_plugin_init_t)(void);
+
+const struct nu801_plugin *nu801_plugin_init(void);
+
+#endif /* _NU801_PLUGIN_H_ */
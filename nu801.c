@@ -6,7 +6,9 @@
  * This code was based on gpio-utils + uledmon from the linux
  * kernel source... as well as leds-nu801.c from Kevin Paul Herbert.
  *
- * gcc -D_GNU_SOURCE -Os -o nu801 -std=gnu11 gpio-utils.c nu801.c
+ * gcc -D_GNU_SOURCE -Os -o nu801 -std=gnu11 gpio-utils.c effects.c pattern.c \
+ *     animation.c plugins.c sources.c histogram.c trace.c log.c nu801.c \
+ *     -lm -ldl -lpthread
  *
  * For more information about the chip, visit: http://www.numen-tech.com
  *
@@ -14,7 +16,9 @@
  */
 
 #include <stdint.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <math.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
@@ -28,14 +32,72 @@
 
 #include <sys/select.h>
 #include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #include <linux/gpio.h>
 #include <linux/uleds.h>
 
 #include "gpio-utils.h"
+#include "effects.h"
+#include "pattern.h"
+#include "animation.h"
+#include "plugins.h"
+#include "sources.h"
+#include "histogram.h"
+#include "trace.h"
+#include "probes.h"
+#include "log.h"
+#include "sdo.h"
 
 enum gpio_type { NUMBER };
 
+/* what animates the channels, instead of just their LEDs' brightness */
+enum nu801_source {
+	SOURCE_NONE = 0,
+	SOURCE_EFFECT,
+	SOURCE_PATTERN,
+	SOURCE_FILE,
+	SOURCE_PLUGIN,
+	SOURCE_NETDEV,
+	SOURCE_CPU,
+	SOURCE_DISK,
+};
+
+/*
+ * transfer curves that map the LED brightness onto the 16-bit PWM.
+ * LEGACY is what the original kernel driver did (brightness << 8).
+ */
+enum nu801_curve {
+	CURVE_LEGACY = 0,
+	CURVE_LINEAR,
+	CURVE_GAMMA22,
+	CURVE_CIE1931,
+};
+
+static const char *const curve_names[] = {
+	[CURVE_LEGACY] = "legacy",
+	[CURVE_LINEAR] = "linear",
+	[CURVE_GAMMA22] = "gamma",
+	[CURVE_CIE1931] = "cie",
+};
+
+/*
+ * White balance / color correction. The matrix maps the 16-bit PWM
+ * values of the channels (in the order of .colors) onto the corrected
+ * ones, the gain is applied per channel afterwards. Both are Q12
+ * fixed-point (4096 = 1.0).
+ */
+struct nu801_color_correction {
+	int16_t matrix[3][3];
+	uint16_t gain[3];
+};
+
+#define Q12(x) ((int)((x) * 4096 + 0.5))
+
 /*
  * Here we describe our supported hardware
  * the "id" gets passed as the programs one and only parameter
@@ -56,7 +118,19 @@ static const struct hardware_definitions {
 			} num;
 		};
 	} gpio;
-	unsigned int ndelay;
+
+	/*
+	 * The minimum widths (ns) of the CKI high and low phases and of the
+	 * LEI pulse. Only the part that the GPIO ioctl itself doesn't take
+	 * already is actually waited for.
+	 */
+	struct {
+		unsigned int cki_high;
+		unsigned int cki_low;
+		unsigned int lei;
+	} pulse;
+	enum nu801_curve curve;
+	const struct nu801_color_correction *correction; /* NULL = none */
 	const char *colors[3];		/* nu801 has max. 3 channels */
 	const char *functions[3];	/* likewise... 3 channels */
 } supported_hardware[] = {
@@ -72,7 +146,7 @@ static const struct hardware_definitions {
 				.lei = 5,
 			},
 		},
-		.ndelay = 150,
+		.pulse = { .cki_high = 150, .cki_low = 150, .lei = 150 },
 		.colors = { "blue", "green", "red" },
 		.functions = { "tricolor", "tricolor", "tricolor" },
 	},
@@ -89,7 +163,7 @@ static const struct hardware_definitions {
 				.lei = ~0,
 			},
 		},
-		.ndelay = 500,
+		.pulse = { .cki_high = 500, .cki_low = 500, .lei = 500 },
 		.colors = { "blue", "green", "red" },
 		.functions = { "tricolor", "tricolor", "tricolor" },
 	},
@@ -106,7 +180,7 @@ static const struct hardware_definitions {
 				.lei = ~0,
 			},
 		},
-		.ndelay = 500,
+		.pulse = { .cki_high = 500, .cki_low = 500, .lei = 500 },
 		.colors = { "red", "green", "blue" },
 		.functions = { "tricolor", "tricolor", "tricolor" },
 	},
@@ -122,7 +196,7 @@ static const struct hardware_definitions {
 				.lei = 1,
 			},
 		},
-		.ndelay = 500,
+		.pulse = { .cki_high = 500, .cki_low = 500, .lei = 500 },
 		.colors = { "blue", "green", "red" },
 		.functions = { "tricolor", "tricolor", "tricolor" },
 	},
@@ -134,29 +208,245 @@ struct nu801_led_struct {
 	struct uleds_user_dev uleds_dev;
 	int fd; /* /dev/uleds handle */
 	int brightness; /* current brightness */
+
+	/* virtual LEDs act on the new brightness, channels just store it */
+	void (*update)(struct nu801_led_struct *led);
+};
+
+/*
+ * Presets (or scenes) are complete colors that can be applied with a
+ * single write to the "preset" LED. The LED's brightness value is the
+ * index into this table. Since the channel order differs between the
+ * boards, the values are stored by color and mapped onto the channels
+ * once a preset gets selected.
+ */
+struct nu801_preset {
+	const char *name;
+	unsigned int red, green, blue;
+};
+
+#define NU801_MAX_PRESETS 16
+
+static struct nu801_preset presets[NU801_MAX_PRESETS] = {
+	{ "off",	0,	0,	0 },
+	{ "booting",	0,	0,	255 },
+	{ "online",	0,	255,	0 },
+	{ "degraded",	255,	96,	0 },
+	{ "upgrade",	255,	0,	255 },
+};
+static unsigned int num_presets = 5;
+
+/*
+ * Layers are virtual LEDs (like "amber:alert" or "white:locate") that
+ * are composited on top of the channels, so several agents can share
+ * the one tricolor LED. The LED's brightness is the layer's intensity.
+ */
+enum nu801_blend {
+	BLEND_REPLACE = 0,	/* the layer's color, if it is on */
+	BLEND_MAX,		/* the brighter one of both per channel */
+	BLEND_ADD,		/* both added, saturating */
+	BLEND_ALPHA,		/* brightness fades the layer's color in */
+};
+
+static const char *const blend_names[] = {
+	[BLEND_REPLACE] = "replace",
+	[BLEND_MAX] = "max",
+	[BLEND_ADD] = "add",
+	[BLEND_ALPHA] = "alpha",
+};
+
+struct nu801_layer {
+	const char *name;	/* color:function of the LED */
+	unsigned int red, green, blue;
+	int priority;		/* higher ones are composited last (on top) */
+	enum nu801_blend blend;
+
+	struct nu801_led_struct *led;
+	bool dirty;
+	uint32_t alpha;		/* Q16 */
+	int32_t pwm[3];		/* the layer's channels, cached */
 };
 
+#define NU801_MAX_LAYERS 4
+
+static struct nu801_layer layers[NU801_MAX_LAYERS];
+static unsigned int num_layers;
+
+/* the three channels + the virtual preset, effect, dimmer and layer LEDs */
+#define NU801_MAX_LEDS (6 + NU801_MAX_LAYERS)
+
 /* Program State */
 static volatile sig_atomic_t fatal_error_in_progress = 0;
 static struct gpio_v2_line_values values = { 0 };
-static struct nu801_led_struct leds[3] = { 0 };
+static struct nu801_led_struct leds[NU801_MAX_LEDS] = { 0 };
 static const struct hardware_definitions *dev;
 static unsigned int num_leds;
+static unsigned int num_channels;
+static int channel_rgb[3]; /* red, green or blue (0-2) per channel, or -1 */
+
+/*
+ * What the daemon did so far. There's only the one thread, so these are
+ * plain counters. The struct gets its own cache line(s), away from the
+ * data the frame encoder reads.
+ */
+static struct nu801_stats {
+	uint64_t events[NU801_MAX_LEDS];	/* uleds writes per LED */
+	uint64_t frames;		/* sent to the chip */
+	uint64_t frames_skipped;	/* frame timer expirations missed */
+	uint64_t events_merged;		/* events that shared a frame */
+	uint64_t ioctl_errors;
+	uint64_t frame_ns;		/* time spent sending frames */
+	uint64_t latch_waits;		/* 600us pseudo latches */
+	uint64_t bytes_shifted;
+	uint64_t delays_elided;		/* the ioctl took long enough */
+	uint64_t frames_verified;	/* read back through SDO */
+	uint64_t frame_mismatches;	/* that didn't come back as sent */
+	uint64_t bits_mismatched;
+	uint64_t retransmits;
+	uint64_t verify_failures;	/* still wrong after all retransmits */
+} stats __attribute__((aligned(64)));
+
+static const char *metrics_path; /* Prometheus textfile, NULL = none */
+
+/* the latencies in ns, dumped on SIGUSR1 or by the histograms command */
+static struct histogram hist_frame = { .name = "frame" };
+static struct histogram hist_latch = { .name = "event_to_latch" };
+static struct histogram hist_ioctl = { .name = "ioctl" };
+static struct histogram hist_delay = { .name = "delay" };
+
+static struct histogram *const histograms[] = {
+	&hist_frame, &hist_latch, &hist_ioctl, &hist_delay,
+};
+
+static uint64_t event_ns; /* the first uleds event since the last frame */
+
+static struct trace_ring trace;
+static int marker_fd = -1; /* tracefs' trace_marker */
+static const char *trace_path; /* where SIGUSR1 dumps the trace */
+static int signal_fd = -1;
+static uint16_t transfer[65536];
+static int curve = -1; /* -1 = use the board's default */
+static int max_brightness = 255; /* 65535 in 16-bit passthrough mode */
+static int32_t color_matrix[3][3]; /* Q12, gain already folded in */
+static unsigned int gain[3] = { Q12(1), Q12(1), Q12(1) };
+
+/*
+ * The global dimmer ("night mode"). The dimmer LED and the daily
+ * schedule both scale all channels, the product of them is folded into
+ * the color matrix - so it is free for the frame encoder.
+ */
+struct nu801_dim_step {
+	unsigned int minute;	/* of the day, local time */
+	unsigned int percent;
+};
+
+static struct nu801_dim_step dim_steps[8];
+static unsigned int num_dim_steps;
+static unsigned int dim_led = Q12(1), dim_scheduled = Q12(1);
+static int dim_fd = -1;
+
+/*
+ * The power budget limits the sum of the channels' duty cycles, in
+ * percent of one channel at full drive. A thermal zone tightens it
+ * further, from its hot temperature on down to a quarter at critical.
+ */
+static unsigned int budget_percent; /* 0 = unlimited */
+static struct thermal_source thermal = { .fd = -1 };
+static int thermal_hot = 60000, thermal_crit = 80000; /* m°C */
+static uint32_t budget_limit; /* for the sum of the frame, 0 = none */
+static uint32_t derating = 65536; /* Q16, of the last frame */
+static int slow_fd = -1;
+
+#define SLOW_INTERVAL_S 5
+/*
+ * fades of the channels between their old and new brightness. These
+ * are done on the PWM values, so even 8-bit LEDs fade in 16-bit steps.
+ */
+struct nu801_transition {
+	uint16_t from, to;
+	uint64_t start, end;
+};
+
+static struct nu801_transition transitions[3];
+static unsigned int transition_ms[3]; /* per channel, 0 = no fading */
+static enum nu801_source source;
+static uint64_t source_epoch; /* when the source was started */
+static uint64_t source_frames; /* frames played from an animation file */
+static const struct effect *effect; /* for SOURCE_EFFECT */
+static struct pattern pattern;
+static struct pattern_vm pattern_vm;
+static struct animation animation;
+
+/*
+ * Notifications are short patterns (i.e. "config applied" as three green
+ * flashes) that get played over whatever the source shows. They wait in
+ * a small fixed queue, the one with the highest priority goes first and
+ * those that didn't get their turn before their TTL ran out are dropped.
+ */
+struct nu801_notification {
+	struct pattern pattern;
+	int priority;
+	uint64_t expires;	/* ns, the notification is dropped then */
+	uint32_t seq;		/* first come, first served */
+	bool queued;
+};
+
+#define NU801_MAX_NOTIFICATIONS 8
+
+static struct nu801_notification notifications[NU801_MAX_NOTIFICATIONS];
+static struct nu801_notification *notification; /* the one playing */
+static struct pattern_vm notification_vm;
+static uint32_t notification_seq;
+static uint64_t notifications_expired;
+
+static struct plugin plugins[4];
+static unsigned int num_plugins;
+static struct plugin *plugin; /* for SOURCE_PLUGIN */
+static unsigned int plugin_budget_us; /* 0 = a quarter of a frame */
+static struct netdev_source netdev = { .proc_fd = -1, .nl_fd = -1 };
+static struct cpu_source cpu = { .proc_fd = -1 };
+static struct disk_source disk = { .proc_fd = -1 };
+static int sample_fd = -1;
+static unsigned int sample_ms = 250;
+static uint16_t gauge_rgb[3]; /* the color a sampled source shows */
+static int frame_fd = -1;
+static uint64_t frame_deadline; /* 0 = frame timer is idle */
+static uint64_t frame_deadline_rt; /* wall clock time of an effect's frame */
+static int64_t phase_error_ns, phase_error_max_ns;
+static unsigned int fps = 50;
 static int gpio_fd;
+static unsigned int sdo_line = ~0; /* the cascade output's GPIO, -V */
+static int sdo_offset; /* see sdo.h, nu801-calibrate tells */
+static int sdo_fd = -1;
 static bool daemonize = true;
-static bool debug = false;
 
-#define DPRINTF(fmt, ...) { if (debug) printf((fmt), ##__VA_ARGS__); }
+/* -d, -DNU801_LOG_LEVEL=1 leaves the per event and frame ones out */
+#define DPRINTF(fmt, ...) LOG(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+#define TPRINTF(fmt, ...) LOG(LOG_LEVEL_TRACE, fmt, ##__VA_ARGS__)
 #define PID_NOBODY 65534
 #define GID_NOGROUP 65534
 #define RUNFILE "/var/run/nu801.pid"
+#define RUNSOCK "/var/run/nu801.sock"
+
+#define CONTROL_MAX_CLIENTS 4
 
-static int register_uled(struct nu801_led_struct *led,
+/* control socket */
+static int control_fd = -1;
+static int control_clients[CONTROL_MAX_CLIENTS] = { -1, -1, -1, -1 };
+static const char *control_path = RUNSOCK;
+
+static int register_uled(unsigned int n,
 			const char *board, const char *color,
-			const char *function)
+			const char *function, int max_brightness)
 {
+	struct nu801_led_struct *led;
 	int ret;
 
+	/* leds[] is sized for the channels and all the virtual LEDs */
+	if (n >= ARRAY_SIZE(leds))
+		return -ENOSPC;
+	led = &leds[n];
+
 	/* sprintf_s would be cool... but alas */
 	if (board)
 		snprintf((char *)&led->uleds_dev.name, LED_MAX_NAME_SIZE-1, "%s:%s:%s",
@@ -165,7 +455,7 @@ static int register_uled(struct nu801_led_struct *led,
 		snprintf((char *)&led->uleds_dev.name, LED_MAX_NAME_SIZE-1, "%s:%s",
 			color, function);
 
-	led->uleds_dev.max_brightness = 255;
+	led->uleds_dev.max_brightness = max_brightness;
 
 	led->fd = open("/dev/uleds", O_RDWR);
 	if (led->fd == -1) {
@@ -240,22 +530,257 @@ static int register_gpio(const struct hardware_definitions *dev)
 	return _gpio_fd;
 }
 
+/*
+ * The NU801's cascade output (SDO) is meant for the next chip's SDI.
+ * If it is wired to an input instead, what the chip really got can be
+ * read back.
+ */
+static int register_sdo(const struct hardware_definitions *dev)
+{
+	struct gpio_v2_line_config config = { 0 };
+	int ret;
+
+	config.flags = GPIO_V2_LINE_FLAG_INPUT;
+
+	DPRINTF("Reading frames back through line '%u' (offset %d).\n",
+		sdo_line, sdo_offset);
+	ret = gpiotools_request_line(dev->gpio.gpiochip, &sdo_line, 1,
+				     &config, "nu801-sdo");
+	if (ret < 0)
+		perror("Failed to request the SDO line");
+
+	return ret;
+}
+
+/*
+ * precompute the brightness -> PWM lookup table once, so the
+ * frame encoder just has to do a lookup per channel.
+ */
+static void transfer_init(enum nu801_curve curve, unsigned int max)
+{
+	unsigned int i;
+	double x, l;
+
+	for (i = 0; i <= max && i < ARRAY_SIZE(transfer); i++) {
+		x = (double)i / max;
+
+		switch (curve) {
+		case CURVE_LEGACY:
+			/* i << 8 or, in 16-bit mode, just the value itself */
+			transfer[i] = i * (65536 / (max + 1));
+			break;
+		case CURVE_LINEAR:
+			transfer[i] = lround(x * 65535.0);
+			break;
+		case CURVE_GAMMA22:
+			transfer[i] = lround(pow(x, 2.2) * 65535.0);
+			break;
+		case CURVE_CIE1931:
+			/* inverse of the CIE L* lightness function */
+			l = x * 100.0;
+			if (l <= 8.0)
+				x = l / 903.3;
+			else
+				x = pow((l + 16.0) / 116.0, 3.0);
+			transfer[i] = lround(x * 65535.0);
+			break;
+		}
+	}
+}
+
+static int parse_curve(const char *arg)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(curve_names); i++) {
+		if (!strcmp(arg, curve_names[i]))
+			return i;
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * folds the board's (or the user's) gain into the correction matrix,
+ * so that the frame encoder only has to do one multiply per entry.
+ */
+static void correction_init(const struct nu801_color_correction *cc)
+{
+	unsigned int row, col;
+	int32_t m;
+
+	for (row = 0; row < 3; row++) {
+		for (col = 0; col < 3; col++) {
+			if (cc)
+				m = cc->matrix[row][col];
+			else
+				m = (row == col) ? Q12(1) : 0;
+
+			if (cc)
+				m = (m * cc->gain[row]) >> 12;
+
+			m = (m * (int32_t)gain[row]) >> 12;
+			m = (m * (int32_t)((dim_led * dim_scheduled) >> 12)) >> 12;
+
+			/* keep the encoder's sum of products within 32-bit */
+			if (m > Q12(2))
+				m = Q12(2);
+			else if (m < -Q12(2))
+				m = -Q12(2);
+			color_matrix[row][col] = m;
+		}
+	}
+}
+
+/* parses "HH:MM=percent" and adds it to the schedule, in order */
+static int parse_dim_step(const char *arg)
+{
+	unsigned int hour, min, percent, minute, i;
+	char end;
+
+	if (sscanf(arg, "%u:%u=%u%c", &hour, &min, &percent, &end) != 3 ||
+	    hour > 23 || min > 59 || percent > 100)
+		return -EINVAL;
+
+	minute = hour * 60 + min;
+	for (i = 0; i < num_dim_steps && dim_steps[i].minute < minute; i++)
+		;
+
+	if (i == num_dim_steps || dim_steps[i].minute != minute) {
+		if (num_dim_steps >= ARRAY_SIZE(dim_steps))
+			return -ENOSPC;
+
+		memmove(&dim_steps[i + 1], &dim_steps[i],
+			(num_dim_steps - i) * sizeof(dim_steps[0]));
+		num_dim_steps++;
+	}
+
+	dim_steps[i].minute = minute;
+	dim_steps[i].percent = percent;
+	return 0;
+}
+
+/* parses "zone[:hot[:critical]]", the temperatures in °C */
+static int parse_thermal(char *arg, const char **zone)
+{
+	int hot = thermal_hot / 1000, crit = thermal_crit / 1000;
+	char *colon;
+
+	colon = strchr(arg, ':');
+	if (colon) {
+		*colon = '\0';
+		if (sscanf(colon + 1, "%d:%d", &hot, &crit) < 1)
+			return -EINVAL;
+	}
+
+	if (!*arg || crit <= hot)
+		return -EINVAL;
+
+	*zone = arg;
+	thermal_hot = hot * 1000;
+	thermal_crit = crit * 1000;
+	return 0;
+}
+
+/* parses "line[:offset]" of -V */
+static int parse_sdo(const char *arg)
+{
+	int offset = 0;
+	char *end;
+
+	sdo_line = strtoul(arg, &end, 0);
+	if (end == arg || (*end && sscanf(end, ":%d", &offset) != 1) ||
+	    offset < SDO_OFFSET_MIN || offset > SDO_OFFSET_MAX)
+		return -EINVAL;
+
+	sdo_offset = offset;
+	return 0;
+}
+
+/* parses "gain0,gain1,gain2" (channel order) like "1.0,0.85,0.9" */
+static int parse_gain(const char *arg)
+{
+	double g[3];
+	unsigned int i;
+
+	if (sscanf(arg, "%lf,%lf,%lf", &g[0], &g[1], &g[2]) != 3)
+		return -EINVAL;
+
+	for (i = 0; i < ARRAY_SIZE(g); i++) {
+		if (g[i] < 0.0 || g[i] > 2.0)
+			return -EINVAL;
+		gain[i] = Q12(g[i]);
+	}
+
+	return 0;
+}
+
 static inline void gpio_set(const enum nu801_gpio_t gpio, const bool state)
 {
 	gpiotools_assign_bit(&values.bits, gpio, state);
 }
 
+static inline bool gpio_sdo(void)
+{
+	struct gpio_v2_line_values sdo = { .mask = 1 };
+
+	if (gpiotools_get_values(sdo_fd, &sdo) < 0)
+		stats.ioctl_errors++;
+
+	return sdo.bits & 1;
+}
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * The fastest a GPIO ioctl takes lately (ns). It follows a faster one
+ * right away, but a slower one only slowly. So it stays close to the
+ * lower bound, which is what a pulse can be relied on to last.
+ */
+static uint64_t ioctl_floor_ns;
+
 static inline void gpio_commit(void)
 {
-	gpiotools_set_values(gpio_fd, &values);
+	uint64_t start = monotonic_ns(), end;
+
+	if (gpiotools_set_values(gpio_fd, &values) < 0)
+		stats.ioctl_errors++;
+
+	/* the lines have changed by now */
+	end = monotonic_ns();
+	histogram_add(&hist_ioctl, end - start);
+	if (end - start < ioctl_floor_ns || !ioctl_floor_ns)
+		ioctl_floor_ns = end - start;
+	else
+		ioctl_floor_ns += (end - start - ioctl_floor_ns) >> 8;
+	if (trace.enabled)
+		trace_add(&trace, end, TRACE_GPIO, 0, values.bits);
 }
 
-/* yee, this are probably entirely cosmetic */
+/*
+ * yee, this are probably entirely cosmetic... nanosleep() takes tens
+ * of us no matter what, so the short ones are spun instead.
+ */
 static void ndelay(const long nsec)
 {
 	struct timespec sleep = { 0, nsec };
+	uint64_t start = monotonic_ns(), now;
+
+	if (nsec >= 50000) {
+		nanosleep(&sleep, NULL);
+		now = monotonic_ns();
+	} else {
+		while ((now = monotonic_ns()) - start < (uint64_t)nsec)
+			;
+	}
 
-	nanosleep(&sleep, NULL);
+	histogram_add(&hist_delay, now - start);
 }
 
 static void udelay(const unsigned short usec)
@@ -269,122 +794,1881 @@ static void udelay(const unsigned short usec)
 	ndelay(usec * 1000);
 }
 
-static void handle_leds(const struct hardware_definitions *dev)
+/* lines the frames up with the kernel's ftrace, if asked to */
+static inline void marker(const char *msg)
 {
-	struct nu801_led_struct *led;
-	uint16_t hwval, bit;
-	unsigned int i;
+	/* it's best effort, a frame is not held up by a failed write */
+	if (marker_fd >= 0)
+		write(marker_fd, msg, strlen(msg));
+}
 
-	/*
-	 * bit-bang the 3 x 16-Bit PWM values. There's no fancy protocol,
-	 * just the raw values, one after the other and bit by bit...
-	 *
-	 * No, I don't think the ndelay will accomplish much, it's there
-	 * "for show".
-	 */
+/*
+ * holds the lines for at least ns. The next commit takes at least the
+ * ioctl's floor to happen, so only the rest needs to be waited for.
+ */
+static inline void pulse_wait(unsigned int ns)
+{
+	if (ns > ioctl_floor_ns)
+		ndelay(ns - ioctl_floor_ns);
+	else
+		stats.delays_elided++;
+}
 
-	for (i = 0, led = &leds[0]; i < num_leds; led++, i++) {
+/* measures the ioctls once before the first frame */
+static void gpio_calibrate(void)
+{
+	unsigned int i;
 
-		/*
-		 * Linux's defines the range for LED brightness from
-		 * 0 = LED_OFF, 1 = LED_ON, 127 = LED_HALF and 255 = LED_FULL
-		 *
-		 * The LED_ON doesn't quite fit in this series. But
-		 * since we want to provide bug-for-bug compatibility
-		 * with the existing driver... we do what it did to
-		 * convert these values to something the 16-bit PWM
-		 * can better understand.
-		 */
-		hwval = led->brightness << 8;
+	/* the lines don't change, so the chip doesn't notice */
+	for (i = 0; i < 64; i++)
+		gpio_commit();
 
-		/* xmit each bit... starting from the MSB */
-		for (bit = 0x8000; bit; bit >>= 1) {
-			gpio_set(NU801_SDI, !!(hwval & bit));
-			gpio_set(NU801_CKI, 1);
-			gpio_commit();
+	DPRINTF("GPIO ioctl takes at least %llu ns\n",
+		(unsigned long long)ioctl_floor_ns);
+}
 
-			if (((i == (num_leds - 1)) && (bit == 1) &&
-				   !(~0 ^ dev->gpio.num.lei))) {
+/* clamps v to 0..65535 without any branches */
+static inline int32_t clamp_u16(int32_t v)
+{
+	v &= ~(v >> 31);
+	return v - ((v - 65535) & ((65535 - v) >> 31));
+}
 
-				/*
-				 * From the datasheet:
-				 * "When clock signal keep high for more than
-				 * 600us, NU801 will generate an internal
-				 * pseudo LE signal. That will trigger the
-				 * data latch circut to hold the
-				 * luminance data.
-				 */
-				udelay(600);
-			} else {
-				/*
-				 * Userspace is so slow that this nano-second
-				 * delay are completely wasted cycles.
-				 * ndelay(dev->ndelay);
-				 */
-			}
-			gpio_set(NU801_CKI, 0);
-			gpio_commit();
+/* index of a color in red, green, blue order, or -1 */
+static int color_index(const char *color)
+{
+	static const char *const rgb[] = { "red", "green", "blue" };
+	unsigned int i;
 
-			ndelay(dev->ndelay);
-		}
+	for (i = 0; i < ARRAY_SIZE(rgb); i++) {
+		if (!strcmp(color, rgb[i]))
+			return i;
 	}
 
-	/*
-	 * In case we have the latch connected through a GPIO,
-	 * we can just trigger it, instead of wasting 600us.
-	 */
-	if ((~0 ^ dev->gpio.num.lei)) {
-		gpio_set(NU801_LEI, 1);
-		gpio_commit();
+	return -1;
+}
 
-		ndelay(dev->ndelay);
+static uint64_t realtime_ns(void)
+{
+	struct timespec now;
 
-		gpio_set(NU801_LEI, 0);
-		gpio_commit();
-	}
+	clock_gettime(CLOCK_REALTIME, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
 }
 
-static void teardown(void)
+/*
+ * Q16 position within the effect's period. The periods are counted
+ * from the epoch, so all units with a NTP-synced clock show the very
+ * same phase without having to talk to each other.
+ */
+static uint32_t effect_phase(void)
 {
-	unsigned int i;
+	uint64_t period = effect->period_ms * 1000000ULL;
 
-	if (gpio_fd > 0) {
-		DPRINTF("turning off LEDs on shutdown\n");
-		/* turn off the lights before exitting. */
-		for (i = 0; i < num_leds; i++)
-			leds[i].brightness = 0;
+	return ((realtime_ns() % period) << 16) / period;
+}
 
-		handle_leds(dev);
+/* maps 16-bit red, green, blue onto the board's channels */
+static void rgb_to_levels(const uint16_t *rgb, int *level)
+{
+	unsigned int i;
 
-		DPRINTF("releasing GPIOs back to the kernel.\n");
-		gpiotools_release_line(gpio_fd);
-		gpio_fd = -1;
+	for (i = 0; i < num_channels; i++) {
+		level[i] = channel_rgb[i] < 0 ? 0 :
+			   ((uint32_t)rgb[channel_rgb[i]] * max_brightness) / 65535;
 	}
+}
 
-	for (i = 0; i < ARRAY_SIZE(leds); i++) {
-		if (leds[i].fd > 0) {
-			DPRINTF("unregistering LED %u\n", i);
-			close(leds[i].fd);
-			leds[i].fd = -1;
+/* the brightness of each channel for this frame */
+static void render_levels(int *level)
+{
+	int base[3] = { 0 };
+	uint16_t rgb[3];
+	unsigned int i;
+
+	for (i = 0; i < num_channels; i++)
+		base[i] = leds[i].brightness;
+
+	switch (source) {
+	case SOURCE_EFFECT:
+		effect->render(effect_phase(), base, level, num_channels,
+			       max_brightness);
+		break;
+	case SOURCE_PATTERN:
+		pattern_color(&pattern_vm, monotonic_ns(), rgb);
+		rgb_to_levels(rgb, level);
+		break;
+	case SOURCE_FILE:
+		/* the file has the PWM words already, see encode_frame() */
+		break;
+	case SOURCE_NETDEV:
+	case SOURCE_CPU:
+	case SOURCE_DISK:
+		rgb_to_levels(gauge_rgb, level);
+		break;
+	case SOURCE_PLUGIN:
+		memcpy(level, base, sizeof(base));
+		if (!plugin_render(plugin, realtime_ns(), level, num_channels,
+				   plugin_budget_us ? plugin_budget_us * 1000ULL :
+				   1000000000ULL / fps / 4)) {
+			memcpy(level, base, sizeof(base));
+			break;
+		}
+
+		/* the plugin's values are going to index transfer[] */
+		for (i = 0; i < num_channels; i++) {
+			if (level[i] < 0)
+				level[i] = 0;
+			else if (level[i] > max_brightness)
+				level[i] = max_brightness;
 		}
+		break;
+	case SOURCE_NONE:
+	default:
+		memcpy(level, base, sizeof(base));
+		break;
 	}
 }
 
-static void fatal_error_signal(int sig)
+static uint16_t transition_value(const struct nu801_transition *t,
+				 uint64_t now)
 {
-	/* catch cascading errors. if we end up here then elevate this */
-	if (fatal_error_in_progress)
-		raise(sig);
+	if (now >= t->end)
+		return t->to;
 
-	fatal_error_in_progress = 1;
+	return t->from + ((int32_t)t->to - t->from) *
+			 (int64_t)(now - t->start) / (int64_t)(t->end - t->start);
+}
 
-	teardown();
+/* fade channel i from where it is now to its LED's new brightness */
+static void start_transition(unsigned int i, uint64_t now)
+{
+	struct nu801_transition *t = &transitions[i];
 
-	signal(sig, SIG_DFL);
-	raise(sig);
+	t->from = transition_value(t, now);
+	t->to = transfer[leds[i].brightness];
+	t->start = now;
+	t->end = now + transition_ms[i] * 1000000ULL;
 }
 
-static int catch_fatal_errors(void)
+/* the time the last running transition ends, 0 if there is none */
+static uint64_t transitions_end(uint64_t now)
+{
+	uint64_t end = 0;
+	unsigned int i;
+
+	for (i = 0; i < num_channels; i++) {
+		if (transitions[i].end > now && transitions[i].end > end)
+			end = transitions[i].end;
+	}
+
+	return end;
+}
+
+/* recomputes a layer's cached channels, once its LED changed */
+static void layer_prepare(struct nu801_layer *layer)
+{
+	const unsigned int rgb[] = { layer->red, layer->green, layer->blue };
+	unsigned int i, value;
+	int idx;
+
+	layer->alpha = ((uint64_t)layer->led->brightness << 16) / max_brightness;
+
+	for (i = 0; i < num_channels; i++) {
+		idx = color_index(dev->colors[i]);
+		value = idx < 0 ? 0 : rgb[idx] * (max_brightness / 255);
+
+		/* alpha fades in the full color, the others are dimmed */
+		if (layer->blend != BLEND_ALPHA)
+			value = ((uint64_t)value * layer->alpha) >> 16;
+
+		layer->pwm[i] = transfer[value];
+	}
+
+	layer->dirty = false;
+}
+
+/* the layers are sorted by priority, so this is a single flat pass */
+static void composite_layers(int32_t *pwm)
+{
+	struct nu801_layer *layer;
+	unsigned int i, l;
+
+	for (l = 0, layer = layers; l < num_layers; l++, layer++) {
+		if (layer->dirty)
+			layer_prepare(layer);
+
+		if (!layer->alpha)
+			continue;
+
+		for (i = 0; i < num_channels; i++) {
+			switch (layer->blend) {
+			case BLEND_REPLACE:
+				pwm[i] = layer->pwm[i];
+				break;
+			case BLEND_MAX:
+				if (layer->pwm[i] > pwm[i])
+					pwm[i] = layer->pwm[i];
+				break;
+			case BLEND_ADD:
+				pwm[i] = clamp_u16(pwm[i] + layer->pwm[i]);
+				break;
+			case BLEND_ALPHA:
+				pwm[i] += ((int64_t)(layer->pwm[i] - pwm[i]) *
+					   layer->alpha) >> 16;
+				break;
+			}
+		}
+	}
+}
+
+static void encode_frame(uint16_t *frame)
+{
+	int32_t pwm[3] = { 0 };
+	uint64_t now = monotonic_ns();
+	uint16_t rgb[3];
+	uint32_t sum = 0;
+	int level[3];
+	unsigned int i;
+
+	if (notification) {
+		/* a notification is shown instead of the source */
+		pattern_color(&notification_vm, now, rgb);
+		rgb_to_levels(rgb, level);
+	} else {
+		render_levels(level);
+	}
+
+	for (i = 0; i < num_channels; i++) {
+		if (source == SOURCE_NONE && !notification) {
+			/* the LEDs' brightness, fading if configured */
+			pwm[i] = transition_value(&transitions[i], now);
+			continue;
+		}
+
+		if (source == SOURCE_FILE && !notification) {
+			/* the frames are prerendered, no curve to apply */
+			pwm[i] = channel_rgb[i] < 0 ? 0 :
+				 animation.value[channel_rgb[i]];
+			continue;
+		}
+
+		/*
+		 * Linux's defines the range for LED brightness from
+		 * 0 = LED_OFF, 1 = LED_ON, 127 = LED_HALF and 255 = LED_FULL
+		 *
+		 * The LED_ON doesn't quite fit in this series. But
+		 * since we want to provide bug-for-bug compatibility
+		 * with the existing driver... the legacy curve does
+		 * what it did to convert these values to something
+		 * the 16-bit PWM can better understand. The other
+		 * curves make use of the full 16-bit range.
+		 */
+		pwm[i] = transfer[level[i]];
+	}
+
+	composite_layers(pwm);
+
+	/*
+	 * The color correction. The coefficients are limited to +-2.0,
+	 * so the sum of the three products still fits into 32-bit.
+	 */
+	for (i = 0; i < num_channels; i++) {
+		frame[i] = clamp_u16((pwm[0] * color_matrix[i][0] +
+				      pwm[1] * color_matrix[i][1] +
+				      pwm[2] * color_matrix[i][2]) >> 12);
+		sum += frame[i];
+	}
+
+	/* scaling all channels alike keeps the color */
+	derating = 65536;
+	if (budget_limit && sum > budget_limit) {
+		derating = ((uint64_t)budget_limit << 16) / sum;
+		for (i = 0; i < num_channels; i++)
+			frame[i] = (frame[i] * derating) >> 16;
+	}
+}
+
+/*
+ * A latch leaves CKI (the pseudo latch) or LEI high. They only come down
+ * again with the next frame's first ioctl, which puts out its first bit
+ * as well. So that bit doesn't need an ioctl of its own.
+ */
+static bool lines_parked;
+
+/*
+ * bit-bangs the frame into the chip and latches it, if asked to. With
+ * readback, the chip's previous contents are sampled from SDO before
+ * each rising edge, as they are shifted out.
+ *
+ * SDI only ever changes in the ioctl that lowers CKI, so it is set up a
+ * whole low phase before the chip samples it on the rising edge. Which
+ * line a GPIO controller writes first doesn't matter then.
+ */
+static void shift_frame(const struct hardware_definitions *dev,
+			const uint16_t *frame, uint8_t *readback, bool latch)
+{
+	bool lei = ~0 ^ dev->gpio.num.lei, first, next;
+	uint16_t hwval, bit;
+	unsigned int i;
+
+	if (!num_channels)
+		return;
+
+	if (latch && trace.enabled) {
+		for (i = 0; i < num_channels; i++)
+			trace_add(&trace, monotonic_ns(), TRACE_FRAME, i,
+				  frame[i]);
+	}
+
+	/*
+	 * bit-bang the 3 x 16-Bit PWM values. There's no fancy protocol,
+	 * just the raw values, one after the other and bit by bit...
+	 *
+	 * The delays only make up for what the ioctls don't take already.
+	 */
+
+	/*
+	 * the first bit goes out with the last latch's release. Only after
+	 * a read-back pass, CKI is low already and SDI may be wrong.
+	 */
+	first = frame[0] & 0x8000;
+	if (lines_parked ||
+	    gpiotools_test_bit(values.bits, NU801_SDI) != first) {
+		gpio_set(NU801_SDI, first);
+		gpio_set(NU801_CKI, 0);
+		if (lei)
+			gpio_set(NU801_LEI, 0);
+		gpio_commit();
+		pulse_wait(dev->pulse.cki_low);
+		lines_parked = false;
+	}
+
+	for (i = 0; i < num_channels; i++) {
+		hwval = frame[i];
+
+		/* xmit each bit... starting from the MSB */
+		for (bit = 0x8000; bit; bit >>= 1) {
+			if (readback)
+				*readback++ = gpio_sdo();
+
+			gpio_set(NU801_CKI, 1);
+			gpio_commit();
+
+			if (latch && !lei && i == num_channels - 1 && bit == 1) {
+				/*
+				 * From the datasheet:
+				 * "When clock signal keep high for more than
+				 * 600us, NU801 will generate an internal
+				 * pseudo LE signal. That will trigger the
+				 * data latch circut to hold the
+				 * luminance data.
+				 *
+				 * CKI stays high until the next frame.
+				 */
+				NU801_PROBE0(latch_begin);
+				udelay(600);
+				NU801_PROBE0(latch_end);
+				stats.latch_waits++;
+				lines_parked = true;
+				break;
+			}
+
+			/*
+			 * Userspace is so slow that the ioctl alone
+			 * is usually longer than this.
+			 */
+			pulse_wait(dev->pulse.cki_high);
+
+			/*
+			 * and the next bit goes out with the falling edge.
+			 * After the last one, that's the first one again,
+			 * in case the frame is sent once more.
+			 */
+			if (bit > 1)
+				next = hwval & (bit >> 1);
+			else
+				next = frame[(i + 1) % num_channels] & 0x8000;
+			gpio_set(NU801_SDI, next);
+			gpio_set(NU801_CKI, 0);
+			gpio_commit();
+			pulse_wait(dev->pulse.cki_low);
+		}
+	}
+	stats.bytes_shifted += num_channels * sizeof(frame[0]);
+
+	/*
+	 * In case we have the latch connected through a GPIO,
+	 * we can just trigger it, instead of wasting 600us.
+	 * LEI stays high until the next frame.
+	 */
+	if (latch && lei) {
+		NU801_PROBE0(latch_begin);
+		gpio_set(NU801_LEI, 1);
+		gpio_commit();
+		pulse_wait(dev->pulse.lei);
+		NU801_PROBE0(latch_end);
+		lines_parked = true;
+	}
+}
+
+/* brings CKI and LEI down, before the lines are given back */
+static void gpio_idle(const struct hardware_definitions *dev)
+{
+	gpio_set(NU801_CKI, 0);
+	if (~0 ^ dev->gpio.num.lei)
+		gpio_set(NU801_LEI, 0);
+	gpio_commit();
+	lines_parked = false;
+}
+
+#define NU801_VERIFY_RETRIES 3
+
+/*
+ * The latched frame can only be read back by shifting the next one in.
+ * So the frame is shifted in once more, without a latch, and whatever
+ * comes out of SDO has to be the frame. If it isn't, it is sent again.
+ */
+static void verify_frame(const struct hardware_definitions *dev,
+			 const uint16_t *frame)
+{
+	uint8_t sent[3 * 16], readback[3 * 16];
+	unsigned int i, retries, errors;
+
+	for (i = 0; i < num_channels * 16; i++)
+		sent[i] = (frame[i / 16] >> (15 - i % 16)) & 1;
+
+	for (retries = 0; ; retries++) {
+		shift_frame(dev, frame, readback, false);
+		stats.frames_verified++;
+
+		errors = sdo_mismatches(sent, readback, num_channels * 16,
+					sdo_offset);
+		if (!errors)
+			return;
+
+		NU801_PROBE1(frame_mismatch, errors);
+		stats.frame_mismatches++;
+		stats.bits_mismatched += errors;
+		if (retries == NU801_VERIFY_RETRIES) {
+			DPRINTF("frame still wrong after %u retransmits\n",
+				retries);
+			stats.verify_failures++;
+			return;
+		}
+
+		TPRINTF("frame mismatch (%u bits), retransmitting\n", errors);
+		stats.retransmits++;
+		shift_frame(dev, frame, NULL, true);
+	}
+}
+
+static void handle_leds(const struct hardware_definitions *dev)
+{
+	uint64_t start = monotonic_ns(), end;
+	uint16_t frame[3];
+
+	NU801_PROBE0(frame_start);
+	marker("nu801: frame_start\n");
+
+	encode_frame(frame);
+	shift_frame(dev, frame, NULL, true);
+	if (sdo_fd >= 0)
+		verify_frame(dev, frame);
+
+	end = monotonic_ns();
+	NU801_PROBE1(frame_end, end - start);
+	marker("nu801: frame_end\n");
+	stats.frames++;
+	stats.frame_ns += end - start;
+	histogram_add(&hist_frame, end - start);
+
+	if (event_ns) {
+		histogram_add(&hist_latch, end - event_ns);
+		event_ns = 0;
+	}
+}
+
+static unsigned int preset_value(const struct nu801_preset *preset,
+				 const char *color)
+{
+	const unsigned int rgb[] = { preset->red, preset->green, preset->blue };
+	int idx = color_index(color);
+
+	return idx < 0 ? 0 : rgb[idx];
+}
+
+/*
+ * advances the animation file to the frame that is due now. Frames
+ * that were missed are skipped, so the animation stays on time.
+ */
+static uint64_t animation_advance(uint64_t now)
+{
+	uint64_t due;
+
+	due = (now - source_epoch) * animation.fps / 1000000000ULL + 1;
+	while (source_frames < due) {
+		if (!animation_next(&animation)) {
+			DPRINTF("Animation finished\n");
+			animation_close(&animation);
+			source = SOURCE_NONE;
+			return 0;
+		}
+		source_frames++;
+	}
+
+	return source_epoch + source_frames * 1000000000ULL / animation.fps;
+}
+
+/* the next frame at the frame rate, keeping the cadence of the last ones */
+static uint64_t next_frame(uint64_t now, uint64_t interval)
+{
+	if (frame_deadline > now)
+		return frame_deadline;
+
+	if (frame_deadline && frame_deadline + interval > now)
+		return frame_deadline + interval;
+
+	return now + interval;
+}
+
+/* the queued notification that is next in line, the expired ones are gone */
+static struct nu801_notification *notification_pick(uint64_t now)
+{
+	struct nu801_notification *n, *best = NULL;
+
+	for (n = notifications; n < notifications + ARRAY_SIZE(notifications); n++) {
+		/* the playing one is left to notification_schedule() */
+		if (!n->queued || n == notification)
+			continue;
+
+		if (n->expires <= now) {
+			DPRINTF("Notification %u expired\n", n->seq);
+			n->queued = false;
+			notifications_expired++;
+			continue;
+		}
+
+		if (!best || n->priority > best->priority ||
+		    (n->priority == best->priority && n->seq < best->seq))
+			best = n;
+	}
+
+	return best;
+}
+
+/*
+ * advances the playing notification and starts the next one once it is
+ * done. Returns when the notifications need the next frame, 0 if none
+ * is left. This runs off the frame timer, like the sources.
+ */
+static uint64_t notification_schedule(uint64_t now, uint64_t interval)
+{
+	uint64_t next;
+
+	for (;;) {
+		if (!notification) {
+			notification = notification_pick(now);
+			if (!notification)
+				return 0;
+
+			DPRINTF("Playing notification %u\n", notification->seq);
+			pattern_start(&notification_vm, &notification->pattern,
+				      now);
+		}
+
+		/* a looping one just plays until its TTL */
+		next = now < notification->expires ?
+		       pattern_run(&notification_vm, now) : 0;
+		if (next)
+			break;
+
+		notification->queued = false;
+		notification = NULL;
+	}
+
+	if (notification_vm.ramping && next > now + interval)
+		next = now + interval;
+	if (next > notification->expires)
+		next = notification->expires;
+
+	return next;
+}
+
+/*
+ * (re)arms the frame timer for the next frame or keyframe. Everything
+ * that animates is computed in the daemon, so there are no wakeups from
+ * the outside needed while a source is running.
+ */
+static int schedule_frame(uint64_t now)
+{
+	struct itimerspec its = { 0 };
+	uint64_t interval = 1000000000ULL / fps, next = 0, end, rt;
+
+	switch (source) {
+	case SOURCE_PLUGIN:
+		if (plugin->disabled) {
+			fprintf(stderr, "nu801: plugin '%s' is too slow, disabled\n",
+				plugin->ops->name);
+			source = SOURCE_NONE;
+			break;
+		}
+		/* fall through */
+	case SOURCE_EFFECT:
+		/*
+		 * the frames are on a grid counted from the epoch as well.
+		 * The timer is still a monotonic one, it is re-aligned with
+		 * every frame in case the wall clock got stepped.
+		 */
+		rt = realtime_ns();
+		frame_deadline_rt = (rt / interval + 1) * interval;
+		next = now + (frame_deadline_rt - rt);
+		break;
+	case SOURCE_PATTERN:
+		/* patterns only need frames while they are ramping */
+		next = pattern_run(&pattern_vm, now);
+		if (next && pattern_vm.ramping && next > now + interval)
+			next = now + interval;
+		break;
+	case SOURCE_FILE:
+		next = animation_advance(now);
+		break;
+	case SOURCE_NONE:
+	default:
+		/* frames at the frame rate until the fades are done */
+		end = transitions_end(now);
+		if (!end)
+			break;
+
+		next = next_frame(now, interval);
+		if (next > end)
+			next = end;
+		break;
+	}
+
+	end = notification_schedule(now, interval);
+	if (end && (!next || end < next)) {
+		/* that frame is off the effect's grid */
+		next = end;
+		frame_deadline_rt = 0;
+	}
+
+	frame_deadline = next;
+	its.it_value.tv_sec = next / 1000000000ULL;
+	its.it_value.tv_nsec = next % 1000000000ULL;
+	return timerfd_settime(frame_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/*
+ * the sampled sources ("gauges") are driven by their own, slower timer.
+ * They are selected like the effects, through the effect LED they come
+ * after the plugins - in this order, if they are set up.
+ */
+static const struct gauge {
+	const char *name;
+	enum nu801_source source;
+	const int *fd;
+} gauges[] = {
+	{ "netdev", SOURCE_NETDEV, &netdev.proc_fd },
+	{ "cpu", SOURCE_CPU, &cpu.proc_fd },
+	{ "disk", SOURCE_DISK, &disk.proc_fd },
+};
+
+static bool source_sampled(enum nu801_source src)
+{
+	return src == SOURCE_NETDEV || src == SOURCE_CPU || src == SOURCE_DISK;
+}
+
+static unsigned int num_gauges(void)
+{
+	unsigned int i, num = 0;
+
+	for (i = 0; i < ARRAY_SIZE(gauges); i++)
+		num += *gauges[i].fd >= 0;
+
+	return num;
+}
+
+/* finds a set up gauge by name or by index */
+static const struct gauge *gauge_find(const char *name, unsigned int idx)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(gauges); i++) {
+		if (*gauges[i].fd < 0)
+			continue;
+
+		if (name ? !strcmp(name, gauges[i].name) : !idx--)
+			return &gauges[i];
+	}
+
+	return NULL;
+}
+
+static void gauge_sample(uint64_t now)
+{
+	switch (source) {
+	case SOURCE_NETDEV:
+		netdev_sample(&netdev, now);
+		break;
+	case SOURCE_CPU:
+		cpu_sample(&cpu);
+		break;
+	case SOURCE_DISK:
+		disk_sample(&disk, now);
+		break;
+	default:
+		break;
+	}
+}
+
+static int sample_timer(bool enable)
+{
+	struct itimerspec its = { 0 };
+
+	if (enable) {
+		its.it_interval.tv_sec = sample_ms / 1000;
+		its.it_interval.tv_nsec = (sample_ms % 1000) * 1000000L;
+		its.it_value = its.it_interval;
+	}
+
+	return timerfd_settime(sample_fd, 0, &its, NULL);
+}
+
+/* updates the sampled source's color, returns true if it changed */
+static bool update_gauge(void)
+{
+	uint16_t rgb[3];
+
+	switch (source) {
+	case SOURCE_NETDEV:
+		netdev_color(&netdev, rgb);
+		break;
+	case SOURCE_CPU:
+		gauge_color(cpu.load, rgb);
+		break;
+	case SOURCE_DISK:
+		gauge_color(disk.load, rgb);
+		break;
+	default:
+		return false;
+	}
+
+	if (!memcmp(rgb, gauge_rgb, sizeof(rgb)))
+		return false;
+
+	memcpy(gauge_rgb, rgb, sizeof(rgb));
+	return true;
+}
+
+static void set_source(enum nu801_source new_source,
+		       const struct effect *new_effect)
+{
+	uint64_t now = monotonic_ns();
+
+	if (source_sampled(source) != source_sampled(new_source) &&
+	    sample_timer(source_sampled(new_source)))
+		perror("Failed to set sample timer");
+
+	if (source == SOURCE_FILE && new_source != SOURCE_FILE)
+		animation_close(&animation);
+
+	source = new_source;
+	source_epoch = now;
+	frame_deadline_rt = 0;
+	source_frames = 0;
+	effect = new_effect;
+
+	if (source == SOURCE_PATTERN)
+		pattern_start(&pattern_vm, &pattern, now);
+	else if (source == SOURCE_FILE)
+		animation_rewind(&animation);
+	else if (source_sampled(source))
+		gauge_sample(now);
+	update_gauge();
+
+	frame_deadline = 0;
+	if (schedule_frame(now))
+		perror("Failed to set frame timer");
+}
+
+/*
+ * live updates of the channels take precedence over a running pattern
+ * or animation. The effects on the other hand use them as their color.
+ */
+static void channel_update(struct nu801_led_struct *led)
+{
+	uint64_t now = monotonic_ns();
+
+	start_transition(led - leds, now);
+
+	if (source == SOURCE_PATTERN || source == SOURCE_FILE)
+		set_source(SOURCE_NONE, NULL);
+	else if (source == SOURCE_NONE && schedule_frame(now))
+		perror("Failed to set frame timer");
+}
+
+static void preset_update(struct nu801_led_struct *led)
+{
+	const struct nu801_preset *preset;
+	unsigned int i;
+
+	if (led->brightness < 0 || (unsigned int)led->brightness >= num_presets)
+		return;
+
+	preset = &presets[led->brightness];
+	DPRINTF("Applying preset %d '%s'\n", led->brightness, preset->name);
+
+	/*
+	 * all channels change at once, so this ends up as a single frame.
+	 * The presets are 8-bit, in 16-bit mode 255 has to become 65535.
+	 */
+	for (i = 0; i < num_channels; i++) {
+		leds[i].brightness = preset_value(preset, dev->colors[i]) *
+				     (max_brightness / 255);
+		channel_update(&leds[i]);
+	}
+}
+
+static void start_plugin(struct plugin *p)
+{
+	DPRINTF("Starting plugin '%s'\n", p->ops->name);
+	plugin = p;
+	set_source(SOURCE_PLUGIN, NULL);
+}
+
+static void effect_update(struct nu801_led_struct *led)
+{
+	unsigned int idx = led->brightness;
+	const struct gauge *g;
+
+	/*
+	 * 0 = off, everything else selects the effect with index - 1.
+	 * The plugins come right after the built-in effects.
+	 */
+	if (idx > 0 && idx <= num_effects) {
+		DPRINTF("Starting effect '%s'\n", effects[idx - 1].name);
+		set_source(SOURCE_EFFECT, &effects[idx - 1]);
+	} else if (idx > num_effects && idx <= num_effects + num_plugins) {
+		start_plugin(&plugins[idx - num_effects - 1]);
+	} else if (idx > num_effects + num_plugins &&
+		   (g = gauge_find(NULL, idx - num_effects - num_plugins - 1))) {
+		DPRINTF("Starting %s source\n", g->name);
+		set_source(g->source, NULL);
+	} else if (source == SOURCE_EFFECT || source == SOURCE_PLUGIN ||
+		   source_sampled(source)) {
+		DPRINTF("Stopping effect\n");
+		set_source(SOURCE_NONE, NULL);
+	}
+}
+
+static int frame_tick(void)
+{
+	uint64_t expirations, now, skipped;
+
+	if (read(frame_fd, &expirations, sizeof(expirations)) < 0)
+		return errno == EAGAIN ? 0 : -errno;
+
+	/* frames that were due while the daemon was busy elsewhere */
+	now = monotonic_ns();
+	if (frame_deadline && now > frame_deadline) {
+		skipped = (now - frame_deadline) / (1000000000ULL / fps);
+		if (skipped) {
+			NU801_PROBE1(frame_skipped, skipped);
+			stats.frames_skipped += skipped;
+		}
+	}
+
+	/* how far off the wall clock grid the effect's frame is */
+	if ((source == SOURCE_EFFECT || source == SOURCE_PLUGIN) &&
+	    frame_deadline_rt) {
+		phase_error_ns = realtime_ns() - frame_deadline_rt;
+		if (llabs(phase_error_ns) > phase_error_max_ns)
+			phase_error_max_ns = llabs(phase_error_ns);
+	}
+
+	if (schedule_frame(now))
+		return -errno;
+
+	/* this is also the last frame once a source has finished */
+	handle_leds(dev);
+	return 0;
+}
+
+/*
+ * applies the step of the schedule that is due now and arms the timer
+ * for the next one. It's an absolute timer on the wall clock, so it
+ * fires once per step. If the clock is set, it is cancelled and this
+ * starts over.
+ */
+static int dim_schedule(void)
+{
+	struct itimerspec its = { 0 };
+	const struct nu801_dim_step *step;
+	time_t now = time(NULL), next;
+	unsigned int minute, i;
+	struct tm tm;
+
+	localtime_r(&now, &tm);
+	minute = tm.tm_hour * 60 + tm.tm_min;
+
+	/* the last step that has begun today, or else yesterday's last one */
+	for (i = num_dim_steps; i > 0 && dim_steps[i - 1].minute > minute; i--)
+		;
+
+	step = &dim_steps[i ? i - 1 : num_dim_steps - 1];
+	DPRINTF("Dimming to %u%%\n", step->percent);
+	dim_scheduled = Q12(1) * step->percent / 100;
+
+	/* the next one is either later today or the first one tomorrow */
+	step = &dim_steps[i < num_dim_steps ? i : 0];
+	if (i == num_dim_steps)
+		tm.tm_mday++;
+	tm.tm_hour = step->minute / 60;
+	tm.tm_min = step->minute % 60;
+	tm.tm_sec = 0;
+	tm.tm_isdst = -1;
+	next = mktime(&tm);
+
+	/* the hour that repeats when DST ends */
+	if (next <= now)
+		next = now + 60;
+
+	its.it_value.tv_sec = next;
+	return timerfd_settime(dim_fd, TFD_TIMER_ABSTIME |
+			       TFD_TIMER_CANCEL_ON_SET, &its, NULL);
+}
+
+static int dim_tick(void)
+{
+	uint64_t expirations;
+
+	/* ECANCELED means that the clock was set */
+	if (read(dim_fd, &expirations, sizeof(expirations)) < 0 &&
+	    errno != ECANCELED)
+		return errno == EAGAIN ? 0 : -errno;
+
+	if (dim_schedule())
+		return -errno;
+
+	correction_init(dev->correction);
+	handle_leds(dev);
+	return 0;
+}
+
+/* the dimmer LED's brightness is how much it dims, 0 leaves it alone */
+static void dim_update(struct nu801_led_struct *led)
+{
+	dim_led = Q12(1) -
+		  ((uint64_t)led->brightness << 12) / max_brightness;
+	correction_init(dev->correction);
+}
+
+/* the limit for the sum of the channels, at the current temperature */
+static void budget_update(void)
+{
+	uint64_t limit = (budget_percent ? budget_percent : 300) * 65535ULL / 100;
+	int temp = thermal.temp;
+
+	if (thermal.fd >= 0 && temp > thermal_hot) {
+		if (temp > thermal_crit)
+			temp = thermal_crit;
+
+		limit -= limit * 3 * (temp - thermal_hot) /
+			 (4 * (thermal_crit - thermal_hot));
+	}
+
+	budget_limit = (budget_percent || thermal.fd >= 0) ? limit : 0;
+}
+
+/* the counters in the Prometheus text format, returns the length */
+static int metrics_format(char *buf, size_t size)
+{
+	static const struct {
+		const char *name, *help;
+		const uint64_t *value;
+	} counters[] = {
+		{ "frames", "Frames sent to the chip", &stats.frames },
+		{ "frames_skipped", "Frames that were due but missed",
+		  &stats.frames_skipped },
+		{ "events_merged", "LED events that shared a frame",
+		  &stats.events_merged },
+		{ "ioctl_errors", "Failed GPIO ioctls", &stats.ioctl_errors },
+		{ "frame_seconds", "Time spent sending frames", &stats.frame_ns },
+		{ "latch_waits", "Pseudo latches (600us each)", &stats.latch_waits },
+		{ "bytes_shifted", "Bytes shifted into the chip",
+		  &stats.bytes_shifted },
+		{ "delays_elided", "Delays the GPIO ioctl already covered",
+		  &stats.delays_elided },
+		{ "frames_verified", "Frames read back through SDO",
+		  &stats.frames_verified },
+		{ "frame_mismatches", "Frames that didn't read back as sent",
+		  &stats.frame_mismatches },
+		{ "bits_mismatched", "Bits that didn't read back as sent",
+		  &stats.bits_mismatched },
+		{ "retransmits", "Frames sent again after a mismatch",
+		  &stats.retransmits },
+		{ "verify_failures", "Frames still wrong after all retransmits",
+		  &stats.verify_failures },
+		{ "log_dropped", "Debug log records that were dropped",
+		  &log_dropped },
+	};
+	unsigned int i;
+	int len;
+
+	len = snprintf(buf, size,
+		       "# HELP nu801_led_events_total Brightness changes per LED\n"
+		       "# TYPE nu801_led_events_total counter\n");
+	for (i = 0; i < num_leds && len < (int)size; i++) {
+		len += snprintf(buf + len, size - len,
+				"nu801_led_events_total{led=\"%s\"} %llu\n",
+				leds[i].uleds_dev.name,
+				(unsigned long long)stats.events[i]);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(counters) && len < (int)size; i++) {
+		len += snprintf(buf + len, size - len,
+				"# HELP nu801_%s_total %s\n"
+				"# TYPE nu801_%s_total counter\n",
+				counters[i].name, counters[i].help,
+				counters[i].name);
+		if (len >= (int)size)
+			break;
+
+		/* the time is kept in ns, Prometheus wants seconds */
+		if (counters[i].value == &stats.frame_ns)
+			len += snprintf(buf + len, size - len,
+					"nu801_%s_total %llu.%09llu\n",
+					counters[i].name,
+					(unsigned long long)(*counters[i].value /
+							     1000000000ULL),
+					(unsigned long long)(*counters[i].value %
+							     1000000000ULL));
+		else
+			len += snprintf(buf + len, size - len,
+					"nu801_%s_total %llu\n", counters[i].name,
+					(unsigned long long)*counters[i].value);
+	}
+
+	if (len < (int)size)
+		len += snprintf(buf + len, size - len,
+				"# HELP nu801_derating_ratio Power budget scale of the last frame\n"
+				"# TYPE nu801_derating_ratio gauge\n"
+				"nu801_derating_ratio %.4f\n",
+				derating / 65536.0);
+
+	/* how far the effects' frames are off the wall clock's grid */
+	if (len < (int)size)
+		len += snprintf(buf + len, size - len,
+				"# HELP nu801_phase_error_seconds Wall clock error of the last effect frame\n"
+				"# TYPE nu801_phase_error_seconds gauge\n"
+				"nu801_phase_error_seconds %.9f\n"
+				"# HELP nu801_phase_error_max_seconds Largest wall clock error of an effect frame\n"
+				"# TYPE nu801_phase_error_max_seconds gauge\n"
+				"nu801_phase_error_max_seconds %.9f\n",
+				phase_error_ns / 1e9, phase_error_max_ns / 1e9);
+
+	return len < (int)size ? len : -ENOSPC;
+}
+
+/*
+ * writes the metrics for node_exporter's textfile collector. It must
+ * never see a half written file, so it's written next to it and renamed.
+ */
+static int metrics_write(void)
+{
+	char buf[4096], tmp[PATH_MAX];
+	int fd, len, ret = 0;
+
+	len = metrics_format(buf, sizeof(buf));
+	if (len < 0)
+		return len;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", metrics_path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	if (write(fd, buf, len) != len)
+		ret = -errno;
+	close(fd);
+
+	if (!ret && rename(tmp, metrics_path))
+		ret = -errno;
+	if (ret)
+		unlink(tmp);
+
+	return ret;
+}
+
+static int trace_write(const char *path)
+{
+	const char *names[NU801_MAX_LEDS];
+	unsigned int i;
+
+	for (i = 0; i < num_leds; i++)
+		names[i] = leds[i].uleds_dev.name;
+
+	return trace_dump(&trace, path, names, num_leds);
+}
+
+/* the slow timer for everything that only needs a look now and then */
+static int slow_timer(void)
+{
+	struct itimerspec its = { 0 };
+
+	if (slow_fd >= 0)
+		return 0;
+
+	slow_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (slow_fd < 0) {
+		perror("Failed to create slow timer");
+		return -errno;
+	}
+
+	its.it_interval.tv_sec = SLOW_INTERVAL_S;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(slow_fd, 0, &its, NULL)) {
+		perror("Failed to set slow timer");
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int slow_tick(void)
+{
+	uint64_t expirations;
+	uint32_t limit = budget_limit;
+
+	if (read(slow_fd, &expirations, sizeof(expirations)) < 0)
+		return errno == EAGAIN ? 0 : -errno;
+
+	if (thermal.fd >= 0) {
+		if (thermal_sample(&thermal))
+			perror("Failed to read the temperature");
+		budget_update();
+	}
+
+	if (budget_limit != limit) {
+		DPRINTF("Power budget is now %u\n", budget_limit);
+		handle_leds(dev);
+	}
+
+	if (metrics_path && metrics_write())
+		perror("Failed to write metrics");
+
+	return 0;
+}
+
+/*
+ * SIGUSR1 dumps the histograms with all their buckets and the trace.
+ * The others ask the daemon to stop, that returns 1.
+ */
+static int signal_tick(void)
+{
+	struct signalfd_siginfo info;
+	static char buf[16384];
+	unsigned int i;
+
+	if (read(signal_fd, &info, sizeof(info)) < 0)
+		return errno == EAGAIN ? 0 : -errno;
+
+	if (info.ssi_signo != SIGUSR1) {
+		DPRINTF("Got signal %u, shutting down\n", info.ssi_signo);
+		return 1;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(histograms); i++) {
+		if (histogram_format(histograms[i], buf, sizeof(buf), true) > 0)
+			fputs(buf, stderr);
+	}
+
+	if (trace_path && trace_write(trace_path))
+		perror("Failed to dump the trace");
+
+	return 0;
+}
+
+static int sample_tick(void)
+{
+	uint64_t expirations;
+
+	if (read(sample_fd, &expirations, sizeof(expirations)) < 0)
+		return errno == EAGAIN ? 0 : -errno;
+
+	gauge_sample(monotonic_ns());
+
+	/* only send a frame if the color has actually changed */
+	if (update_gauge())
+		handle_leds(dev);
+
+	return 0;
+}
+
+static int netdev_tick(void)
+{
+	int ret;
+
+	ret = netdev_link_event(&netdev);
+	if (ret <= 0)
+		return ret;
+
+	DPRINTF("%s: link is %s\n", netdev.ifname, netdev.up ? "up" : "down");
+	if (update_gauge())
+		handle_leds(dev);
+
+	return 0;
+}
+
+/* "ifname[:mbit/s]" */
+static int parse_netdev(char *arg, const char **ifname, uint64_t *max_rate)
+{
+	unsigned long mbit = 1000;
+	char *colon, *end;
+
+	colon = strchr(arg, ':');
+	if (colon) {
+		*colon++ = '\0';
+		mbit = strtoul(colon, &end, 0);
+		if (end == colon || *end || !mbit)
+			return -EINVAL;
+	}
+
+	if (!*arg)
+		return -EINVAL;
+
+	*ifname = arg;
+	*max_rate = mbit * 1000000ULL / 8;
+	return 0;
+}
+
+static int control_effect(char *arg, char *reply, size_t size)
+{
+	const struct gauge *g;
+	const struct effect *e = NULL;
+	unsigned int i;
+
+	g = gauge_find(arg, 0);
+	if (g) {
+		set_source(g->source, NULL);
+		return 0;
+	}
+
+	if (strcmp(arg, "off")) {
+		e = effect_find(arg);
+		if (!e) {
+			for (i = 0; i < num_plugins; i++) {
+				if (!strcmp(plugins[i].ops->name, arg)) {
+					start_plugin(&plugins[i]);
+					return 0;
+				}
+			}
+
+			snprintf(reply, size, "error: unknown effect '%s'\n", arg);
+			return -ENOENT;
+		}
+	}
+
+	set_source(e ? SOURCE_EFFECT : SOURCE_NONE, e);
+	return 0;
+}
+
+static int control_pattern(char *arg, char *reply, size_t size)
+{
+	struct pattern compiled;
+	const char *error;
+
+	if (pattern_compile(arg, &compiled, &error)) {
+		snprintf(reply, size, "error: %s\n", error);
+		return -EINVAL;
+	}
+
+	pattern = compiled;
+	set_source(SOURCE_PATTERN, NULL);
+	return 0;
+}
+
+/* "priority ttl_ms pattern", i.e. "10 5000 loop 3; set 0,255,0; hold 150; set 0,0,0; hold 150; next" */
+static int control_notify(char *arg, char *reply, size_t size)
+{
+	struct nu801_notification *n, *slot = NULL;
+	struct pattern compiled;
+	unsigned int ttl_ms;
+	const char *error;
+	uint64_t now;
+	int priority, pos;
+
+	if (sscanf(arg, "%d %u %n", &priority, &ttl_ms, &pos) != 2 ||
+	    !ttl_ms)
+		return -EINVAL;
+
+	if (pattern_compile(arg + pos, &compiled, &error)) {
+		snprintf(reply, size, "error: %s\n", error);
+		return -EINVAL;
+	}
+
+	/* a free slot, or else the least important one that's waiting */
+	now = monotonic_ns();
+	notification_pick(now);
+	for (n = notifications; n < notifications + ARRAY_SIZE(notifications); n++) {
+		if (!n->queued) {
+			slot = n;
+			break;
+		}
+
+		if (n->priority < priority &&
+		    (!slot || n->priority < slot->priority ||
+		     (n->priority == slot->priority && n->seq > slot->seq)))
+			slot = n;
+	}
+
+	if (!slot)
+		return -EBUSY;
+
+	if (slot->queued) {
+		DPRINTF("Dropping notification %u\n", slot->seq);
+		if (slot == notification)
+			notification = NULL;
+	}
+
+	slot->pattern = compiled;
+	slot->priority = priority;
+	slot->expires = now + ttl_ms * 1000000ULL;
+	slot->seq = ++notification_seq;
+	slot->queued = true;
+
+	/* a more important one interrupts, the other one starts over later */
+	if (notification && priority > notification->priority)
+		notification = NULL;
+
+	if (schedule_frame(now))
+		return -errno;
+
+	snprintf(reply, size, "ok %u\n", slot->seq);
+	return 0;
+}
+
+static int control_play(char *arg, char *reply, size_t size)
+{
+	struct animation anim;
+	int ret;
+
+	ret = animation_open(&anim, arg);
+	if (ret) {
+		snprintf(reply, size, "error: can't play '%s': %s\n", arg,
+			 strerror(-ret));
+		return ret;
+	}
+
+	animation_close(&animation);
+	animation = anim;
+	set_source(SOURCE_FILE, NULL);
+	return 0;
+}
+
+static int control_preset(char *arg, char *reply, size_t size)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_presets; i++) {
+		if (!strcmp(presets[i].name, arg))
+			break;
+	}
+
+	if (i == num_presets) {
+		snprintf(reply, size, "error: unknown preset '%s'\n", arg);
+		return -ENOENT;
+	}
+
+	leds[num_channels].brightness = i;
+	preset_update(&leds[num_channels]);
+	return 0;
+}
+
+/* "transition [color] ms" */
+static int control_transition(char *arg, char *reply, size_t size)
+{
+	unsigned long ms;
+	unsigned int i;
+	char *color = NULL, *end;
+
+	if (strchr(arg, ' ')) {
+		color = arg;
+		arg = strchr(arg, ' ');
+		*arg++ = '\0';
+	}
+
+	ms = strtoul(arg, &end, 0);
+	if (end == arg || *end || ms > 60000) {
+		snprintf(reply, size, "error: invalid time '%s'\n", arg);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < num_channels; i++) {
+		if (!color || !strcmp(color, dev->colors[i]))
+			transition_ms[i] = ms;
+	}
+
+	return 0;
+}
+
+static int control_status(char *arg, char *reply, size_t size)
+{
+	static const char *const source_names[] = {
+		[SOURCE_NONE] = "leds",
+		[SOURCE_EFFECT] = "effect",
+		[SOURCE_PATTERN] = "pattern",
+		[SOURCE_FILE] = "animation",
+		[SOURCE_PLUGIN] = "plugin",
+		[SOURCE_NETDEV] = "netdev",
+		[SOURCE_CPU] = "cpu",
+		[SOURCE_DISK] = "disk",
+	};
+	const struct plugin *p;
+	unsigned int i;
+	int len;
+
+	(void)arg;
+	len = snprintf(reply, size,
+		       "source %s\n"
+		       "effect %s\n"
+		       "phase_error_ns %lld\n"
+		       "phase_error_max_ns %lld\n"
+		       "ioctl_floor_ns %llu\n"
+		       "dim_percent %u\n"
+		       "temperature_mC %d\n"
+		       "budget %u\n"
+		       "derating_percent %u\n"
+		       "notification %u\n"
+		       "notifications_expired %llu\n"
+		       "frame_mismatches %llu\n",
+		       source_names[source], effect ? effect->name : "none",
+		       (long long)phase_error_ns,
+		       (long long)phase_error_max_ns,
+		       (unsigned long long)ioctl_floor_ns,
+		       ((dim_led * dim_scheduled) >> 12) * 100 / Q12(1),
+		       thermal.temp, budget_limit,
+		       (unsigned int)((uint64_t)derating * 100 / 65536),
+		       notification ? notification->seq : 0,
+		       (unsigned long long)notifications_expired,
+		       (unsigned long long)stats.frame_mismatches);
+
+	for (i = 0, p = plugins; i < num_plugins && len < (int)size; i++, p++) {
+		len += snprintf(reply + len, size - len,
+				"plugin %s calls %llu avg_ns %llu max_ns %llu "
+				"overruns %llu%s\n", p->ops->name,
+				(unsigned long long)p->calls,
+				(unsigned long long)(p->calls ?
+					p->total_ns / p->calls : 0),
+				(unsigned long long)p->max_ns,
+				(unsigned long long)p->overruns,
+				p->disabled ? " disabled" : "");
+	}
+
+	for (i = 0; i < num_layers && len < (int)size; i++) {
+		len += snprintf(reply + len, size - len,
+				"layer %s priority %d blend %s brightness %d\n",
+				layers[i].led->uleds_dev.name,
+				layers[i].priority,
+				blend_names[layers[i].blend],
+				layers[i].led->brightness);
+	}
+
+	return 0;
+}
+
+static int control_metrics(char *arg, char *reply, size_t size)
+{
+	(void)arg;
+
+	return metrics_format(reply, size) < 0 ? -ENOSPC : 0;
+}
+
+/* "[name]", all of them in short or the one with its buckets */
+static int control_histograms(char *arg, char *reply, size_t size)
+{
+	unsigned int i;
+	int len = 0, ret;
+
+	for (i = 0; i < ARRAY_SIZE(histograms); i++) {
+		if (*arg && strcmp(arg, histograms[i]->name))
+			continue;
+
+		ret = histogram_format(histograms[i], reply + len, size - len,
+				       *arg);
+		if (ret < 0)
+			return ret;
+		len += ret;
+	}
+
+	return len ? 0 : -ENOENT;
+}
+
+/* "on", "off" or "dump <file>" */
+static int control_trace(char *arg, char *reply, size_t size)
+{
+	(void)reply;
+	(void)size;
+
+	if (!strcmp(arg, "on"))
+		trace.enabled = true;
+	else if (!strcmp(arg, "off"))
+		trace.enabled = false;
+	else if (!strncmp(arg, "dump ", 5) && arg[5])
+		return trace_write(arg + 5);
+	else
+		return -EINVAL;
+
+	return 0;
+}
+
+static int control_stop(char *arg, char *reply, size_t size)
+{
+	(void)arg;
+	(void)reply;
+	(void)size;
+
+	set_source(SOURCE_NONE, NULL);
+	return 0;
+}
+
+static const struct control_command {
+	const char *name;
+	int (*handler)(char *arg, char *reply, size_t size);
+	bool query; /* doesn't change the LEDs, no new frame needed */
+} control_commands[] = {
+	{ .name = "effect", .handler = control_effect, .query = false },
+	{ .name = "histograms", .handler = control_histograms, .query = true },
+	{ .name = "metrics", .handler = control_metrics, .query = true },
+	{ .name = "notify", .handler = control_notify, .query = false },
+	{ .name = "pattern", .handler = control_pattern, .query = false },
+	{ .name = "play", .handler = control_play, .query = false },
+	{ .name = "preset", .handler = control_preset, .query = false },
+	{ .name = "status", .handler = control_status, .query = true },
+	{ .name = "stop", .handler = control_stop, .query = false },
+	{ .name = "trace", .handler = control_trace, .query = true },
+	{ .name = "transition", .handler = control_transition, .query = true },
+};
+
+static int control_open(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("Failed to create control socket");
+		return -errno;
+	}
+
+	/* like the pidfile, remove stale sockets. */
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(fd, CONTROL_MAX_CLIENTS)) {
+		perror("Failed to bind control socket");
+		close(fd);
+		return -errno;
+	}
+
+	chmod(path, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+	return fd;
+}
+
+static void control_accept(void)
+{
+	unsigned int i;
+	int fd;
+
+	fd = accept4(control_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(control_clients); i++) {
+		if (control_clients[i] < 0) {
+			control_clients[i] = fd;
+			return;
+		}
+	}
+
+	DPRINTF("Too many control clients.\n");
+	close(fd);
+}
+
+/*
+ * Every message is one command ("command argument"), the reply is
+ * either "ok", the command's output or "error: ...".
+ */
+static void control_handle(int *client)
+{
+	char buf[1024], reply[4096];
+	char *arg;
+	unsigned int i;
+	ssize_t len;
+	bool query = true;
+	int ret = -ENOENT;
+
+	len = recv(*client, buf, sizeof(buf) - 1, 0);
+	if (len <= 0) {
+		if (len < 0 && errno == EAGAIN)
+			return;
+		close(*client);
+		*client = -1;
+		return;
+	}
+
+	buf[len] = '\0';
+	buf[strcspn(buf, "\r\n")] = '\0';
+	arg = buf + strcspn(buf, " ");
+	if (*arg)
+		*arg++ = '\0';
+
+	DPRINTF("control: '%s' '%s'\n", buf, arg);
+
+	reply[0] = '\0';
+	for (i = 0; i < ARRAY_SIZE(control_commands); i++) {
+		if (!strcmp(buf, control_commands[i].name)) {
+			ret = control_commands[i].handler(arg, reply,
+							  sizeof(reply));
+			query = control_commands[i].query;
+			break;
+		}
+	}
+
+	if (!reply[0]) {
+		if (ret)
+			snprintf(reply, sizeof(reply), "error: %s\n",
+				 strerror(-ret));
+		else
+			strcpy(reply, "ok\n");
+	}
+
+	if (!ret && !query)
+		handle_leds(dev);
+
+	send(*client, reply, strlen(reply), MSG_NOSIGNAL);
+}
+
+static void layer_update(struct nu801_led_struct *led)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_layers; i++) {
+		if (layers[i].led == led)
+			layers[i].dirty = true;
+	}
+}
+
+static int layer_cmp(const void *a, const void *b)
+{
+	const struct nu801_layer *la = a, *lb = b;
+
+	/* a plain difference overflows for the extreme ones */
+	return (la->priority > lb->priority) - (la->priority < lb->priority);
+}
+
+/* parses "color:function=red,green,blue[,priority[,blend]]" */
+static int parse_layer(char *arg)
+{
+	struct nu801_layer *layer;
+	char blend[16] = "max";
+	unsigned int i;
+	char *eq;
+	int n;
+
+	if (num_layers >= ARRAY_SIZE(layers))
+		return -ENOSPC;
+
+	eq = strchr(arg, '=');
+	if (!eq || eq == arg || !strchr(arg, ':'))
+		return -EINVAL;
+	*eq = '\0';
+
+	layer = &layers[num_layers];
+	layer->name = arg;
+	n = sscanf(eq + 1, "%u,%u,%u,%d,%15s", &layer->red, &layer->green,
+		   &layer->blue, &layer->priority, blend);
+	if (n < 3 || layer->red > 255 || layer->green > 255 || layer->blue > 255)
+		return -EINVAL;
+
+	for (i = 0; i < ARRAY_SIZE(blend_names); i++) {
+		if (!strcmp(blend, blend_names[i]))
+			break;
+	}
+
+	if (i == ARRAY_SIZE(blend_names))
+		return -EINVAL;
+
+	layer->blend = i;
+	num_layers++;
+	return 0;
+}
+
+/* parses "name=red,green,blue" and replaces or appends that preset */
+static int parse_preset(char *arg)
+{
+	struct nu801_preset *preset;
+	unsigned int red, green, blue, i;
+	char *eq;
+
+	eq = strchr(arg, '=');
+	if (!eq || eq == arg)
+		return -EINVAL;
+
+	*eq = '\0';
+	if (sscanf(eq + 1, "%u,%u,%u", &red, &green, &blue) != 3 ||
+	    red > 255 || green > 255 || blue > 255)
+		return -EINVAL;
+
+	for (i = 0; i < num_presets; i++) {
+		if (!strcmp(presets[i].name, arg))
+			break;
+	}
+
+	if (i == num_presets) {
+		if (num_presets >= ARRAY_SIZE(presets))
+			return -ENOSPC;
+		num_presets++;
+	}
+
+	preset = &presets[i];
+	preset->name = arg;
+	preset->red = red;
+	preset->green = green;
+	preset->blue = blue;
+	return 0;
+}
+
+static void teardown(void)
+{
+	static const uint16_t off[3];
+	unsigned int i;
+
+	source = SOURCE_NONE;
+	animation_close(&animation);
+	memset(transitions, 0, sizeof(transitions));
+	notification = NULL;
+	for (i = 0; i < ARRAY_SIZE(notifications); i++)
+		notifications[i].queued = false;
+	for (i = 0; i < num_plugins; i++)
+		plugin_unload(&plugins[i]);
+	num_plugins = 0;
+	if (frame_fd >= 0) {
+		close(frame_fd);
+		frame_fd = -1;
+	}
+
+	if (dim_fd >= 0) {
+		close(dim_fd);
+		dim_fd = -1;
+	}
+
+	if (signal_fd >= 0) {
+		close(signal_fd);
+		signal_fd = -1;
+	}
+
+	if (marker_fd >= 0) {
+		close(marker_fd);
+		marker_fd = -1;
+	}
+
+	if (slow_fd >= 0) {
+		close(slow_fd);
+		slow_fd = -1;
+	}
+
+	if (sample_fd >= 0) {
+		close(sample_fd);
+		sample_fd = -1;
+	}
+
+	netdev_close(&netdev);
+	cpu_close(&cpu);
+	thermal_close(&thermal);
+	disk_close(&disk);
+
+	for (i = 0; i < ARRAY_SIZE(control_clients); i++) {
+		if (control_clients[i] >= 0) {
+			close(control_clients[i]);
+			control_clients[i] = -1;
+		}
+	}
+
+	if (control_fd >= 0) {
+		DPRINTF("closing control socket\n");
+		close(control_fd);
+		unlink(control_path);
+		control_fd = -1;
+	}
+
+	if (gpio_fd > 0) {
+		DPRINTF("turning off LEDs on shutdown\n");
+		/*
+		 * turn off the lights before exitting. The layers, the
+		 * notifications and the color matrix all end up in what
+		 * handle_leds() shifts, so latch zeros directly instead.
+		 */
+		shift_frame(dev, off, NULL, true);
+		gpio_idle(dev);
+
+		DPRINTF("releasing GPIOs back to the kernel.\n");
+		gpiotools_release_line(gpio_fd);
+		gpio_fd = -1;
+	}
+
+	if (sdo_fd >= 0) {
+		gpiotools_release_line(sdo_fd);
+		sdo_fd = -1;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(leds); i++) {
+		if (leds[i].fd > 0) {
+			DPRINTF("unregistering LED %u\n", i);
+			close(leds[i].fd);
+			leds[i].fd = -1;
+		}
+	}
+
+	/* what's left in the debug log */
+	log_stop();
+}
+
+/*
+ * Only what is async-signal-safe is done here: the LEDs are turned off
+ * and that's it. The kernel cleans up after the rest, the debug log's
+ * writer thread and the plugins are left alone.
+ */
+static void fatal_error_signal(int sig)
+{
+	static const uint16_t off[3];
+
+	/* catch cascading errors. if we end up here then elevate this */
+	if (fatal_error_in_progress)
+		raise(sig);
+
+	fatal_error_in_progress = 1;
+
+	/* the ring has a single producer, that's the code we interrupted */
+	log_enabled = false;
+
+	if (gpio_fd > 0) {
+		shift_frame(dev, off, NULL, true);
+		gpio_idle(dev);
+	}
+
+	if (control_fd >= 0)
+		unlink(control_path);
+
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+static int catch_fatal_errors(void)
 {
         sigset_t sigs;
 
@@ -405,12 +2689,44 @@ static int catch_fatal_errors(void)
 	return 0;
 }
 
+static inline void watch_fd(int fd, fd_set *set, int *highest)
+{
+	if (fd < 0)
+		return;
+
+	FD_SET(fd, set);
+	if (fd > *highest)
+		*highest = fd;
+}
+
 static void __attribute__ ((noreturn)) usage(int ret)
 {
-	fprintf(stderr, "Usage: nu801 [-P pidfile] [-F] [-d] [-h] device-id\n\n"
+	fprintf(stderr, "Usage: nu801 [-P pidfile] [-S socket] [-A animation] [-F] [-d] [-c curve] [-g g0,g1,g2] [-r fps] [-s name=r,g,b] [-t ms] [-w] [-x plugin] [-B us] [-n ifname[:mbit]] [-D disk] [-i ms] [-l color:function=r,g,b[,prio[,blend]]] [-T HH:MM=percent] [-b percent] [-z zone[:hot[:crit]]] [-m file] [-R file] [-M] [-V line[:offset]] [-h] device-id\n\n"
 		"NU801 userspace controller\n\n"
 		"\t-P\t- specify custom pidfile (default:'" RUNFILE "')\n"
+		"\t-S\t- specify custom control socket (default:'" RUNSOCK "')\n"
+		"\t-A\t- play an animation file on start up.\n"
 		"\t-F\t- run in foreground.\n"
+		"\t-c\t- brightness curve: legacy, linear, gamma or cie.\n"
+		"\t-g\t- per channel gain (0.0-2.0) for the white balance.\n"
+		"\t-r\t- frame rate of the effects (default: 50).\n"
+		"\t-s\t- add or replace a preset (values 0-255 per color).\n"
+		"\t-t\t- fade brightness changes over ms milliseconds.\n"
+		"\t-w\t- 16-bit mode, LEDs take 0-65535 (legacy curve = passthrough).\n"
+		"\t-x\t- load an effect plugin (up to 4).\n"
+		"\t-B\t- time budget of a plugin per frame in us (default: 1/4 frame).\n"
+		"\t-n\t- show the utilization of a network interface (default: 1000 mbit).\n"
+		"\t-D\t- show the I/O load of a disk (i.e. sda).\n"
+		"\t-i\t- sample interval of the sources in ms (default: 250).\n"
+		"\t-l\t- add a layer LED (blend: replace, max, add or alpha).\n"
+		"\t-T\t- dim to percent from this time of the day on (up to 8).\n"
+		"\t-b\t- power budget, sum of all channels in percent of one (1-300).\n"
+		"\t-z\t- derate from hot to crit (default: 60:80 C) of a thermal zone.\n"
+		"\t-m\t- write metrics for Prometheus' textfile collector.\n"
+		"\t-R\t- trace the GPIOs and LEDs, SIGUSR1 dumps it to file.\n"
+		"\t-M\t- write the frames to tracefs' trace_marker.\n"
+		"\t-V\t- verify the frames through SDO wired to this GPIO line,\n"
+		"\t\t  offset as reported by nu801-calibrate (default: 0).\n"
 		"\t-h\t- shows this help.\n"
 		"\n"
 		"\tdevice-id - OF machine compatible/ACPI devicename\n");
@@ -422,14 +2738,24 @@ int main(int argc, char **argv)
 	fd_set rfds;
 	const char *const *color, *const *func;
 	const char *runfile = RUNFILE;
-	unsigned int i;
-	int ret = -EINVAL, pidfd, highest_fd = -1, opt;
+	const char *animfile = NULL;
+	const char *plugin_paths[ARRAY_SIZE(plugins)];
+	unsigned int num_plugin_paths = 0;
+	const char *netdev_name = NULL;
+	const char *disk_name = NULL;
+	const char *thermal_zone = NULL;
+	bool use_marker = false;
+	uint64_t netdev_rate = 0;
+	unsigned int i, l;
+	int ret = -EINVAL, pidfd, highest_fd, opt;
+	unsigned int events;
+	sigset_t sigs;
 	pid_t pid;
 
 	if (catch_fatal_errors())
 		goto out;
 
-	while ((opt = getopt(argc, argv, "P:Fdh")) != -1) {
+	while ((opt = getopt(argc, argv, "P:S:A:Fdc:g:r:s:t:wx:B:n:D:i:l:T:b:z:m:R:MV:h")) != -1) {
 		switch (opt) {
 		case 'P':
 			if (strnlen(optarg,1))
@@ -437,11 +2763,124 @@ int main(int argc, char **argv)
 			else
 				runfile = NULL;
 			break;
+		case 'S':
+			if (strnlen(optarg, 1))
+				control_path = optarg;
+			else
+				control_path = NULL;
+			break;
+		case 'A':
+			animfile = optarg;
+			break;
 		case 'F':
 			daemonize = false;
 			break;
 		case 'd':
-			debug = true;
+			log_enabled = true;
+			break;
+		case 'c':
+			curve = parse_curve(optarg);
+			if (curve < 0) {
+				fprintf(stderr, "nu801: unknown curve '%s'\n", optarg);
+				usage(ret);
+			}
+			break;
+		case 'g':
+			if (parse_gain(optarg)) {
+				fprintf(stderr, "nu801: invalid gain '%s'\n", optarg);
+				usage(ret);
+			}
+			break;
+		case 'r':
+			fps = strtoul(optarg, NULL, 0);
+			if (fps < 1 || fps > 1000) {
+				fprintf(stderr, "nu801: invalid frame rate '%s'\n", optarg);
+				usage(ret);
+			}
+			break;
+		case 's':
+			if (parse_preset(optarg)) {
+				fprintf(stderr, "nu801: invalid preset '%s'\n", optarg);
+				usage(ret);
+			}
+			break;
+		case 't':
+			transition_ms[0] = strtoul(optarg, NULL, 0);
+			if (transition_ms[0] > 60000) {
+				fprintf(stderr, "nu801: invalid transition time '%s'\n", optarg);
+				usage(ret);
+			}
+			transition_ms[1] = transition_ms[2] = transition_ms[0];
+			break;
+		case 'w':
+			max_brightness = 65535;
+			break;
+		case 'x':
+			if (num_plugin_paths >= ARRAY_SIZE(plugin_paths)) {
+				fprintf(stderr, "nu801: too many plugins\n");
+				usage(ret);
+			}
+			plugin_paths[num_plugin_paths++] = optarg;
+			break;
+		case 'B':
+			plugin_budget_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			if (parse_netdev(optarg, &netdev_name, &netdev_rate)) {
+				fprintf(stderr, "nu801: invalid interface '%s'\n", optarg);
+				usage(ret);
+			}
+			break;
+		case 'D':
+			disk_name = optarg;
+			break;
+		case 'i':
+			sample_ms = strtoul(optarg, NULL, 0);
+			if (sample_ms < 10 || sample_ms > 60000) {
+				fprintf(stderr, "nu801: invalid sample interval '%s'\n", optarg);
+				usage(ret);
+			}
+			break;
+		case 'l':
+			if (parse_layer(optarg)) {
+				fprintf(stderr, "nu801: invalid layer '%s'\n", optarg);
+				usage(ret);
+			}
+			break;
+		case 'T':
+			if (parse_dim_step(optarg)) {
+				fprintf(stderr, "nu801: invalid dimmer step '%s'\n", optarg);
+				usage(ret);
+			}
+			break;
+		case 'b':
+			budget_percent = strtoul(optarg, NULL, 0);
+			if (!budget_percent || budget_percent > 300) {
+				fprintf(stderr, "nu801: invalid power budget '%s'\n", optarg);
+				usage(ret);
+			}
+			break;
+		case 'z':
+			if (parse_thermal(optarg, &thermal_zone)) {
+				fprintf(stderr, "nu801: invalid thermal zone '%s'\n", optarg);
+				usage(ret);
+			}
+			break;
+		case 'm':
+			metrics_path = optarg;
+			break;
+		case 'M':
+			use_marker = true;
+			break;
+		case 'R':
+			trace_path = optarg;
+			trace.enabled = true;
+			break;
+		case 'V':
+			if (parse_sdo(optarg)) {
+				fprintf(stderr, "nu801: invalid SDO line '%s'\n", optarg);
+				usage(ret);
+			}
 			break;
 		case 'h':
 			usage(0);
@@ -469,28 +2908,188 @@ int main(int argc, char **argv)
 	DPRINTF("cki:%u sdi:%u lei:%u\n", dev->gpio.num.cki, dev->gpio.num.sdi,
 		dev->gpio.num.lei);
 
-	FD_ZERO(&rfds);
+	if (curve < 0)
+		curve = dev->curve;
+	DPRINTF("Using '%s' brightness curve\n", curve_names[curve]);
+	transfer_init(curve, max_brightness);
+	correction_init(dev->correction);
+
 	for (i = 0, color = dev->colors, func = dev->functions;
 	     *color && *func && i < ARRAY_SIZE(dev->colors);
 	     color++, func++, i++) {
 		DPRINTF("Registering LED %u %s:%s:%s\n", i, dev->board, *color, *func);
-		ret = register_uled(&leds[i], dev->board, *color, *func);
+		ret = register_uled(i, dev->board, *color, *func,
+				    max_brightness);
+		if (ret)
+			goto out;
+		leds[i].update = channel_update;
+		channel_rgb[i] = color_index(*color);
+	}
+	num_channels = i;
+
+	DPRINTF("Registering preset LED with %u presets\n", num_presets);
+	ret = register_uled(i, dev->board, "multicolor", "preset",
+			    num_presets - 1);
+	if (ret)
+		goto out;
+	leds[i++].update = preset_update;
+
+	for (num_plugins = 0; num_plugins < num_plugin_paths; num_plugins++) {
+		DPRINTF("Loading plugin '%s'\n", plugin_paths[num_plugins]);
+		ret = plugin_load(&plugins[num_plugins],
+				  plugin_paths[num_plugins], dev->colors,
+				  num_channels, max_brightness);
 		if (ret)
 			goto out;
+	}
+
+	if (netdev_name) {
+		DPRINTF("Sampling network interface '%s'\n", netdev_name);
+		ret = netdev_open(&netdev, netdev_name, netdev_rate);
+		if (ret) {
+			fprintf(stderr, "nu801: can't sample '%s': %s\n",
+				netdev_name, strerror(-ret));
+			goto out;
+		}
+	}
+
+	if (disk_name) {
+		DPRINTF("Sampling disk '%s'\n", disk_name);
+		ret = disk_open(&disk, disk_name);
+		if (ret) {
+			fprintf(stderr, "nu801: can't sample '%s': %s\n",
+				disk_name, strerror(-ret));
+			goto out;
+		}
+	}
 
-		FD_SET(leds[i].fd, &rfds);
+	/* the CPU load is always there, it's just one fd. */
+	if (cpu_open(&cpu))
+		perror("Failed to open /proc/stat");
 
-		if (leds[i].fd > highest_fd)
-			highest_fd = leds[i].fd;
+	DPRINTF("Registering effect LED with %u effects, %u plugins and %u gauges\n",
+		num_effects, num_plugins, num_gauges());
+	ret = register_uled(i, dev->board, "multicolor", "effect",
+			    num_effects + num_plugins + num_gauges());
+	if (ret)
+		goto out;
+	leds[i++].update = effect_update;
+
+	DPRINTF("Registering dimmer LED\n");
+	ret = register_uled(i, dev->board, "dim", "global",
+			    max_brightness);
+	if (ret)
+		goto out;
+	leds[i++].update = dim_update;
+
+	qsort(layers, num_layers, sizeof(layers[0]), layer_cmp);
+	for (l = 0; l < num_layers; l++) {
+		char *function = strchr(layers[l].name, ':');
+
+		*function++ = '\0';
+		DPRINTF("Registering layer LED %s:%s (priority %d, %s)\n",
+			layers[l].name, function, layers[l].priority,
+			blend_names[layers[l].blend]);
+		ret = register_uled(i, dev->board, layers[l].name,
+				    function, max_brightness);
+		if (ret)
+			goto out;
+		leds[i].update = layer_update;
+		layers[l].led = &leds[i++];
+		layers[l].dirty = true;
 	}
+
 	num_leds = i;
 	DPRINTF("Registered %u LEDs\n", num_leds);
 
+	frame_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (frame_fd < 0) {
+		perror("Failed to create frame timer");
+		ret = -errno;
+		goto out;
+	}
+
+	sample_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (sample_fd < 0) {
+		perror("Failed to create sample timer");
+		ret = -errno;
+		goto out;
+	}
+
+	/* tracefs is mounted in one of these two places */
+	if (use_marker) {
+		marker_fd = open("/sys/kernel/tracing/trace_marker",
+				 O_WRONLY | O_CLOEXEC);
+		if (marker_fd < 0)
+			marker_fd = open("/sys/kernel/debug/tracing/trace_marker",
+					 O_WRONLY | O_CLOEXEC);
+		if (marker_fd < 0) {
+			perror("Failed to open trace_marker");
+			ret = -errno;
+			goto out;
+		}
+	}
+
+	/*
+	 * SIGUSR1 is handled in the main loop, like everything else. So is
+	 * being asked to stop, the plugins are only unloaded from there.
+	 */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGUSR1);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGHUP);
+	if (sigprocmask(SIG_BLOCK, &sigs, NULL) ||
+	    (signal_fd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+		perror("Failed to set up the signals");
+		ret = -errno;
+		goto out;
+	}
+
+	if (num_dim_steps) {
+		dim_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (dim_fd < 0 || dim_schedule()) {
+			perror("Failed to set up the dimmer schedule");
+			ret = -errno;
+			goto out;
+		}
+		correction_init(dev->correction);
+	}
+
+	if (thermal_zone) {
+		DPRINTF("Derating on thermal zone '%s'\n", thermal_zone);
+		ret = thermal_open(&thermal, thermal_zone);
+		if (ret) {
+			fprintf(stderr, "nu801: can't read '%s': %s\n",
+				thermal_zone, strerror(-ret));
+			goto out;
+		}
+
+		ret = slow_timer();
+		if (ret)
+			goto out;
+	}
+	budget_update();
+
+	if (metrics_path) {
+		DPRINTF("Writing metrics to '%s'\n", metrics_path);
+		ret = slow_timer();
+		if (ret)
+			goto out;
+	}
+
 	gpio_fd = register_gpio(dev);
 	if (gpio_fd < 0) {
 		perror("failed to register gpio");
 		goto out;
 	}
+	gpio_calibrate();
+
+	if (sdo_line != ~0U) {
+		sdo_fd = register_sdo(dev);
+		if (sdo_fd < 0)
+			goto out;
+	}
 
 	if (daemonize) {
 		DPRINTF("Summoning the daemon with a fork...\n");
@@ -505,6 +3104,13 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/* the debug log's writer thread belongs to the daemon */
+	ret = log_start();
+	if (ret) {
+		fprintf(stderr, "nu801: can't start the log: %s\n", strerror(-ret));
+		goto out;
+	}
+
 	if (runfile) {
 		DPRINTF("Setting up pid '%s'\n", runfile);
 		/* remove stale pidfiles or nefarious symlinks - see dnsmasq. */
@@ -520,24 +3126,115 @@ int main(int argc, char **argv)
 		close(pidfd);
 	}
 
+	if (control_path) {
+		DPRINTF("Setting up control socket '%s'\n", control_path);
+		control_fd = control_open(control_path);
+		if (control_fd < 0) {
+			ret = control_fd;
+			control_path = NULL;
+			goto out;
+		}
+	}
+
+	if (animfile) {
+		DPRINTF("Playing animation '%s'\n", animfile);
+		ret = animation_open(&animation, animfile);
+		if (ret) {
+			fprintf(stderr, "nu801: can't play '%s': %s\n",
+				animfile, strerror(-ret));
+			goto out;
+		}
+
+		set_source(SOURCE_FILE, NULL);
+		handle_leds(dev);
+	}
+
 	/* no need for special permissions any more. Drop to nobody:nogroup */
 	setgid(GID_NOGROUP);
 	setuid(PID_NOBODY);
 
-	highest_fd++; /* select needs highest_fd + 1 */
 	for (;;) {
-		DPRINTF("Polling LEDs...\n");
-		ret = select(highest_fd, &rfds, NULL, NULL, NULL);
-		DPRINTF("Got an LED event! ret=%d\n", ret);
+		FD_ZERO(&rfds);
+		highest_fd = -1;
+		watch_fd(frame_fd, &rfds, &highest_fd);
+		watch_fd(sample_fd, &rfds, &highest_fd);
+		watch_fd(dim_fd, &rfds, &highest_fd);
+		watch_fd(slow_fd, &rfds, &highest_fd);
+		watch_fd(signal_fd, &rfds, &highest_fd);
+		watch_fd(netdev.nl_fd, &rfds, &highest_fd);
+		watch_fd(control_fd, &rfds, &highest_fd);
+		for (i = 0; i < num_leds; i++)
+			watch_fd(leds[i].fd, &rfds, &highest_fd);
+		for (i = 0; i < ARRAY_SIZE(control_clients); i++)
+			watch_fd(control_clients[i], &rfds, &highest_fd);
+
+		TPRINTF("Polling LEDs...\n");
+		/* select needs highest_fd + 1 */
+		ret = select(highest_fd + 1, &rfds, NULL, NULL, NULL);
+		TPRINTF("Got an LED event! ret=%d\n", ret);
 
 		if (ret < 0)
 			goto out;
 
+		if (FD_ISSET(frame_fd, &rfds)) {
+			ret = frame_tick();
+			if (ret)
+				goto out;
+		}
+
+		if (signal_fd >= 0 && FD_ISSET(signal_fd, &rfds)) {
+			ret = signal_tick();
+			if (ret > 0) {
+				ret = 0;
+				goto out;
+			}
+			if (ret)
+				goto out;
+		}
+
+		if (slow_fd >= 0 && FD_ISSET(slow_fd, &rfds)) {
+			ret = slow_tick();
+			if (ret)
+				goto out;
+		}
+
+		if (dim_fd >= 0 && FD_ISSET(dim_fd, &rfds)) {
+			ret = dim_tick();
+			if (ret)
+				goto out;
+		}
+
+		if (FD_ISSET(sample_fd, &rfds)) {
+			ret = sample_tick();
+			if (ret)
+				goto out;
+		}
+
+		if (netdev.nl_fd >= 0 && FD_ISSET(netdev.nl_fd, &rfds)) {
+			ret = netdev_tick();
+			if (ret)
+				goto out;
+		}
+
+		for (i = 0; i < ARRAY_SIZE(control_clients); i++) {
+			if (control_clients[i] >= 0 &&
+			    FD_ISSET(control_clients[i], &rfds))
+				control_handle(&control_clients[i]);
+		}
+
+		if (control_fd >= 0 && FD_ISSET(control_fd, &rfds))
+			control_accept();
+
+		events = 0;
+
 		for (i = 0; i < num_leds; i++) {
 			if (FD_ISSET(leds[i].fd, &rfds)) {
 				int brightness;
 
-				DPRINTF("LED %u has new data. (old brightness: %d)\n",
+				if (!event_ns)
+					event_ns = monotonic_ns();
+
+				TPRINTF("LED %u has new data. (old brightness: %d)\n",
 					i, leds[i].brightness);
 				ret = read(leds[i].fd, &brightness,
 					   sizeof(brightness));
@@ -547,15 +3244,30 @@ int main(int argc, char **argv)
 					goto out;
 				}
 
-				DPRINTF("set LED %u to brightness %d\n", i, brightness);
+				/* don't trust anyone to index transfer[] */
+				if (brightness < 0)
+					brightness = 0;
+				else if (brightness > leds[i].uleds_dev.max_brightness)
+					brightness = leds[i].uleds_dev.max_brightness;
+
+				TPRINTF("set LED %u to brightness %d\n", i, brightness);
+				NU801_PROBE2(event, i, brightness);
+				if (trace.enabled)
+					trace_add(&trace, monotonic_ns(),
+						  TRACE_EVENT, i, brightness);
 				leds[i].brightness = brightness;
+				if (leds[i].update)
+					leds[i].update(&leds[i]);
+				stats.events[i]++;
+				events++;
 			}
-
-			FD_SET(leds[i].fd, &rfds);
 		}
 
-		DPRINTF("Committing new brightness values to NU801.\n");
-		handle_leds(dev);
+		if (events) {
+			TPRINTF("Committing new brightness values to NU801.\n");
+			stats.events_merged += events - 1;
+			handle_leds(dev);
+		}
 	}
 
 out:
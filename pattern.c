@@ -0,0 +1,355 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Compact bytecode for user-defined LED sequences.
+ *
+ * The language has one statement per line (or separated by ';'):
+ *
+ *	set R,G,B		- switch to a color (0-255 each)
+ *	ramp R,G,B MS		- fade to a color over MS milliseconds
+ *	hold MS			- keep the current color for MS milliseconds
+ *	loop N ... next		- repeat the enclosed statements N times
+ *	jump S			- continue at statement S (counted from 0)
+ *
+ * i.e. two red flashes, a pause and amber:
+ *	loop 2; set 255,0,0; hold 200; set 0,0,0; hold 200; next;
+ *	hold 600; set 255,96,0; hold 2000; jump 0
+ *
+ * The compiler makes sure every loop and every jump contains a hold or
+ * a ramp and that a jump never leaves or enters a loop. So the daemon
+ * never spins in a pattern without time passing.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "pattern.h"
+
+#define PATTERN_MAX_STEPS 64
+
+#define NSEC_PER_MSEC 1000000ULL
+
+struct compiler {
+	struct pattern *pattern;
+	const char *error;
+
+	/* bytecode offset and loop depth of each statement */
+	uint16_t offset[PATTERN_MAX_CODE];
+	uint8_t depth[PATTERN_MAX_CODE];
+	unsigned int stmts;
+
+	unsigned int loops;
+	bool waits[PATTERN_MAX_LOOPS + 1];
+	int last_wait;
+};
+
+static int emit(struct compiler *c, const uint8_t *buf, unsigned int len)
+{
+	struct pattern *p = c->pattern;
+
+	if (p->len + len > PATTERN_MAX_CODE) {
+		c->error = "pattern too long";
+		return -ENOSPC;
+	}
+
+	memcpy(&p->code[p->len], buf, len);
+	p->len += len;
+	return 0;
+}
+
+static int parse_num(const char **s, unsigned long max, unsigned long *val)
+{
+	char *end;
+
+	*val = strtoul(*s, &end, 0);
+	if (end == *s || *val > max)
+		return -EINVAL;
+
+	*s = end;
+	return 0;
+}
+
+static int parse_color(const char **s, uint8_t *rgb)
+{
+	unsigned long val;
+	unsigned int i;
+
+	for (i = 0; i < 3; i++) {
+		if (i && *(*s)++ != ',')
+			return -EINVAL;
+		if (parse_num(s, 255, &val))
+			return -EINVAL;
+		rgb[i] = val;
+	}
+
+	return 0;
+}
+
+static void waited(struct compiler *c, unsigned long ms)
+{
+	if (!ms)
+		return;
+
+	c->waits[c->loops] = true;
+	c->last_wait = c->stmts;
+}
+
+static int compile_stmt(struct compiler *c, const char *s)
+{
+	uint8_t buf[6];
+	unsigned long val;
+	unsigned int target;
+
+	c->offset[c->stmts] = c->pattern->len;
+	c->depth[c->stmts] = c->loops;
+
+	if (!strncmp(s, "set ", 4)) {
+		buf[0] = OP_SET;
+		s += 4;
+		if (parse_color(&s, &buf[1]))
+			goto err_syntax;
+		if (emit(c, buf, 4))
+			return -ENOSPC;
+	} else if (!strncmp(s, "ramp ", 5)) {
+		buf[0] = OP_RAMP;
+		s += 5;
+		if (parse_color(&s, &buf[1]) || parse_num(&s, 65535, &val))
+			goto err_syntax;
+		buf[4] = val & 0xff;
+		buf[5] = val >> 8;
+		if (emit(c, buf, 6))
+			return -ENOSPC;
+		waited(c, val);
+	} else if (!strncmp(s, "hold ", 5)) {
+		buf[0] = OP_HOLD;
+		s += 5;
+		if (parse_num(&s, 65535, &val))
+			goto err_syntax;
+		buf[1] = val & 0xff;
+		buf[2] = val >> 8;
+		if (emit(c, buf, 3))
+			return -ENOSPC;
+		waited(c, val);
+	} else if (!strncmp(s, "loop ", 5)) {
+		buf[0] = OP_LOOP;
+		s += 5;
+		if (parse_num(&s, 255, &val) || !val)
+			goto err_syntax;
+		if (c->loops >= PATTERN_MAX_LOOPS) {
+			c->error = "loops nested too deep";
+			return -EINVAL;
+		}
+		buf[1] = val;
+		if (emit(c, buf, 2))
+			return -ENOSPC;
+		c->waits[++c->loops] = false;
+	} else if (!strncmp(s, "next", 4)) {
+		s += 4;
+		if (!c->loops) {
+			c->error = "next without loop";
+			return -EINVAL;
+		}
+		if (!c->waits[c->loops]) {
+			c->error = "loop without hold or ramp";
+			return -EINVAL;
+		}
+		buf[0] = OP_NEXT;
+		if (emit(c, buf, 1))
+			return -ENOSPC;
+		c->loops--;
+		waited(c, 1);
+	} else if (!strncmp(s, "jump ", 5)) {
+		s += 5;
+		if (parse_num(&s, c->stmts, &val))
+			goto err_syntax;
+		target = val;
+		if (c->loops || c->depth[target]) {
+			c->error = "jump into or out of a loop";
+			return -EINVAL;
+		}
+		if (c->last_wait < (int)target) {
+			c->error = "jump without hold or ramp";
+			return -EINVAL;
+		}
+		buf[0] = OP_JUMP;
+		buf[1] = c->offset[target] & 0xff;
+		buf[2] = c->offset[target] >> 8;
+		if (emit(c, buf, 3))
+			return -ENOSPC;
+	} else {
+		goto err_syntax;
+	}
+
+	s += strspn(s, " \t");
+	if (*s)
+		goto err_syntax;
+
+	c->stmts++;
+	return 0;
+
+err_syntax:
+	c->error = "syntax error";
+	return -EINVAL;
+}
+
+/**
+ * pattern_compile() - translate and validate a pattern
+ * @src:		The pattern's source, see top of this file.
+ * @pattern:		The compiled bytecode.
+ * @error:		Set to a description of what went wrong.
+ *
+ * Return:		On success return 0;
+ *			On failure return the errno.
+ */
+int pattern_compile(const char *src, struct pattern *pattern,
+		    const char **error)
+{
+	struct compiler c = { .pattern = pattern, .last_wait = -1 };
+	char stmt[64];
+	size_t len;
+	int ret;
+
+	pattern->len = 0;
+	while (*src) {
+		src += strspn(src, " \t\r\n;");
+		len = strcspn(src, "\r\n;");
+		if (!len)
+			continue;
+
+		if (len >= sizeof(stmt) || c.stmts >= PATTERN_MAX_CODE) {
+			*error = "statement too long";
+			return -EINVAL;
+		}
+
+		memcpy(stmt, src, len);
+		stmt[len] = '\0';
+		src += len;
+
+		ret = compile_stmt(&c, stmt);
+		if (ret) {
+			*error = c.error;
+			return ret;
+		}
+	}
+
+	if (c.loops) {
+		*error = "loop without next";
+		return -EINVAL;
+	}
+
+	ret = emit(&c, (const uint8_t []){ OP_END }, 1);
+	if (ret)
+		*error = c.error;
+	return ret;
+}
+
+void pattern_start(struct pattern_vm *vm, const struct pattern *pattern,
+		   uint64_t now)
+{
+	memset(vm, 0, sizeof(*vm));
+	vm->pattern = pattern;
+	vm->start = now;
+	vm->until = now;
+}
+
+static inline unsigned int le16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static void load_color(uint16_t *rgb, const uint8_t *p)
+{
+	unsigned int i;
+
+	for (i = 0; i < 3; i++)
+		rgb[i] = p[i] * 257;
+}
+
+/**
+ * pattern_run() - advance the pattern up to the next keyframe
+ * @vm:			The interpreter state.
+ * @now:		CLOCK_MONOTONIC in ns.
+ *
+ * Executes the instructions until the pattern has to wait. Keyframes are
+ * timed relative to each other, so there is no drift. The number of
+ * instructions per call is bounded, should the pattern fall behind it
+ * simply continues with the next call.
+ *
+ * Return:		The time of the next keyframe, or 0 if the pattern
+ *			has finished.
+ */
+uint64_t pattern_run(struct pattern_vm *vm, uint64_t now)
+{
+	const uint8_t *code = vm->pattern->code;
+	unsigned int steps;
+
+	for (steps = 0; !vm->done && vm->until <= now; steps++) {
+		if (steps >= PATTERN_MAX_STEPS)
+			return now;
+
+		if (vm->ramping) {
+			memcpy(vm->from, vm->to, sizeof(vm->from));
+			vm->ramping = false;
+		}
+
+		switch (code[vm->pc]) {
+		case OP_SET:
+			load_color(vm->to, &code[vm->pc + 1]);
+			memcpy(vm->from, vm->to, sizeof(vm->from));
+			vm->pc += 4;
+			break;
+		case OP_RAMP:
+			load_color(vm->to, &code[vm->pc + 1]);
+			vm->start = vm->until;
+			vm->until += le16(&code[vm->pc + 4]) * NSEC_PER_MSEC;
+			vm->ramping = true;
+			vm->pc += 6;
+			break;
+		case OP_HOLD:
+			vm->start = vm->until;
+			vm->until += le16(&code[vm->pc + 1]) * NSEC_PER_MSEC;
+			vm->pc += 3;
+			break;
+		case OP_LOOP:
+			vm->loops[vm->depth].remaining = code[vm->pc + 1];
+			vm->loops[vm->depth].start = vm->pc + 2;
+			vm->depth++;
+			vm->pc += 2;
+			break;
+		case OP_NEXT:
+			if (--vm->loops[vm->depth - 1].remaining) {
+				vm->pc = vm->loops[vm->depth - 1].start;
+			} else {
+				vm->depth--;
+				vm->pc++;
+			}
+			break;
+		case OP_JUMP:
+			vm->pc = le16(&code[vm->pc + 1]);
+			break;
+		case OP_END:
+		default:
+			vm->done = true;
+			break;
+		}
+	}
+
+	return vm->done ? 0 : vm->until;
+}
+
+/* the pattern's color at the time now, interpolated while ramping */
+void pattern_color(const struct pattern_vm *vm, uint64_t now, uint16_t *rgb)
+{
+	uint64_t pos, len;
+	unsigned int i;
+
+	if (!vm->ramping || now >= vm->until) {
+		memcpy(rgb, vm->to, sizeof(vm->to));
+		return;
+	}
+
+	len = vm->until - vm->start;
+	pos = now > vm->start ? now - vm->start : 0;
+	for (i = 0; i < 3; i++)
+		rgb[i] = vm->from[i] + ((int64_t)vm->to[i] - vm->from[i]) *
+			 (int64_t)pos / (int64_t)len;
+}
@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Compact bytecode for user-defined LED sequences.
+ *
+ * A pattern is compiled from a small text language into bytecode once,
+ * the compiler validates everything up front, so the interpreter can
+ * run without any further checks from the daemon's event loop.
+ */
+#ifndef _PATTERN_H_
+#define _PATTERN_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PATTERN_MAX_CODE	256
+#define PATTERN_MAX_LOOPS	4
+
+enum pattern_op {
+	OP_END = 0,
+	OP_SET,		/* red, green, blue */
+	OP_RAMP,	/* red, green, blue, ms (le16) */
+	OP_HOLD,	/* ms (le16) */
+	OP_LOOP,	/* count */
+	OP_NEXT,	/* - */
+	OP_JUMP,	/* offset (le16) */
+};
+
+struct pattern {
+	uint8_t code[PATTERN_MAX_CODE];
+	unsigned int len;
+};
+
+struct pattern_vm {
+	const struct pattern *pattern;
+	unsigned int pc;
+
+	struct {
+		unsigned int start;
+		unsigned int remaining;
+	} loops[PATTERN_MAX_LOOPS];
+	unsigned int depth;
+
+	/* colors are red, green, blue in 0 .. 65535 */
+	uint16_t from[3], to[3];
+	uint64_t start, until;	/* ns, of the running ramp or hold */
+	bool ramping;
+	bool done;
+};
+
+int pattern_compile(const char *src, struct pattern *pattern,
+		    const char **error);
+
+void pattern_start(struct pattern_vm *vm, const struct pattern *pattern,
+		   uint64_t now);
+uint64_t pattern_run(struct pattern_vm *vm, uint64_t now);
+void pattern_color(const struct pattern_vm *vm, uint64_t now,
+		   uint16_t *rgb);
+
+#endif /* _PATTERN_H_ */
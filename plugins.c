@@ -0,0 +1,121 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Loader for effect plugins, see nu801-plugin.h for the interface.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dlfcn.h>
+#include "plugins.h"
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * plugin_load() - load and set up an effect plugin
+ * @plugin:		The plugin's state.
+ * @path:		The shared object.
+ * @colors:		The colors of the channels.
+ * @num:		The number of channels.
+ * @max:		The highest brightness of a channel.
+ *
+ * Return:		On success return 0;
+ *			On failure return the errno.
+ */
+int plugin_load(struct plugin *plugin, const char *path,
+		const char *const *colors, unsigned int num, int max)
+{
+	nu801_plugin_init_t init;
+	int ret;
+
+	memset(plugin, 0, sizeof(*plugin));
+
+	plugin->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!plugin->handle) {
+		fprintf(stderr, "Failed to load plugin: %s\n", dlerror());
+		return -ENOENT;
+	}
+
+	init = (nu801_plugin_init_t)dlsym(plugin->handle, NU801_PLUGIN_INIT);
+	plugin->ops = init ? init() : NULL;
+	if (!plugin->ops || plugin->ops->abi != NU801_PLUGIN_ABI ||
+	    !plugin->ops->name || !plugin->ops->render) {
+		fprintf(stderr, "%s is not a compatible plugin\n", path);
+		ret = -EINVAL;
+		goto err_close;
+	}
+
+	if (plugin->ops->setup) {
+		ret = plugin->ops->setup(colors, num, max);
+		if (ret) {
+			fprintf(stderr, "Failed to set up plugin %s: %s\n",
+				plugin->ops->name, strerror(-ret));
+			goto err_close;
+		}
+	}
+
+	return 0;
+
+err_close:
+	dlclose(plugin->handle);
+	memset(plugin, 0, sizeof(*plugin));
+	return ret;
+}
+
+void plugin_unload(struct plugin *plugin)
+{
+	if (!plugin->handle)
+		return;
+
+	if (plugin->ops->teardown)
+		plugin->ops->teardown();
+
+	dlclose(plugin->handle);
+	memset(plugin, 0, sizeof(*plugin));
+}
+
+/**
+ * plugin_render() - let the plugin render a frame and time it
+ * @plugin:		The plugin.
+ * @t:			The wall clock time in ns.
+ * @channels:		The channels' brightness, in and out.
+ * @num:		The number of channels.
+ * @budget:		The time the plugin may take, in ns.
+ *
+ * Return:		false if the plugin took too long too many times
+ *			in a row. It is disabled from then on.
+ */
+bool plugin_render(struct plugin *plugin, uint64_t t, int *channels,
+		   unsigned int num, uint64_t budget)
+{
+	uint64_t start, took;
+
+	if (plugin->disabled)
+		return false;
+
+	start = monotonic_ns();
+	plugin->ops->render(t, channels, num);
+	took = monotonic_ns() - start;
+
+	plugin->calls++;
+	plugin->total_ns += took;
+	if (took > plugin->max_ns)
+		plugin->max_ns = took;
+
+	if (took > budget) {
+		plugin->overruns++;
+		if (++plugin->strikes >= PLUGIN_MAX_STRIKES)
+			plugin->disabled = true;
+	} else {
+		plugin->strikes = 0;
+	}
+
+	return !plugin->disabled;
+}
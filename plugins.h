@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Loader for effect plugins, see nu801-plugin.h for the interface.
+ */
+#ifndef _PLUGINS_H_
+#define _PLUGINS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "nu801-plugin.h"
+
+/* a plugin gets disabled after this many frames over budget in a row */
+#define PLUGIN_MAX_STRIKES 8
+
+struct plugin {
+	void *handle;
+	const struct nu801_plugin *ops;
+
+	/* render time statistics */
+	uint64_t calls, total_ns, max_ns, overruns;
+	unsigned int strikes;
+	bool disabled;
+};
+
+int plugin_load(struct plugin *plugin, const char *path,
+		const char *const *colors, unsigned int num, int max);
+void plugin_unload(struct plugin *plugin);
+bool plugin_render(struct plugin *plugin, uint64_t t, int *channels,
+		   unsigned int num, uint64_t budget);
+
+#endif /* _PLUGINS_H_ */
@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * USDT probes (the "stapsdt" flavour that perf, bpftrace and systemtap
+ * understand), without needing sys/sdt.h at build time.
+ *
+ * A probe is a single nop in the code plus an ELF note that tells the
+ * tools where that nop is and where its arguments can be found. Until
+ * a tool attaches (and replaces the nop with a breakpoint), the probe
+ * costs exactly that nop.
+ *
+ *	perf probe -x /usr/sbin/nu801 sdt_nu801:frame_start
+ *	bpftrace -e 'usdt:/usr/sbin/nu801:nu801:frame_end { @ = hist(arg0); }'
+ *
+ * The arguments are always unsigned longs. Build with -DNU801_NO_PROBES
+ * to leave them out entirely.
+ */
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+#ifdef NU801_NO_PROBES
+
+#define NU801_PROBE0(name)		do { } while (0)
+#define NU801_PROBE1(name, a)		do { (void)(a); } while (0)
+#define NU801_PROBE2(name, a, b)	do { (void)(a); (void)(b); } while (0)
+
+#else
+
+#if __SIZEOF_POINTER__ == 8
+#define _NU801_SDT_ADDR		".8byte"
+#define _NU801_SDT_SIZE		"8"
+#else
+#define _NU801_SDT_ADDR		".4byte"
+#define _NU801_SDT_SIZE		"4"
+#endif
+
+#define _NU801_SDT_ARG(n)	_NU801_SDT_SIZE "@%[a" #n "]"
+
+/*
+ * the note: the probe's address, the base (to detect prelinking), the
+ * semaphore (none), the provider, the name and the arguments' locations.
+ */
+#define _NU801_SDT(name, args, ...)					\
+	__asm__ __volatile__(						\
+		"990:	nop\n"						\
+		"	.pushsection .note.stapsdt,\"\",\"note\"\n"	\
+		"	.balign 4\n"					\
+		"	.4byte 992f-991f, 994f-993f, 3\n"		\
+		"991:	.asciz \"stapsdt\"\n"				\
+		"992:	.balign 4\n"					\
+		"993:	" _NU801_SDT_ADDR " 990b\n"			\
+		"	" _NU801_SDT_ADDR " _.stapsdt.base\n"		\
+		"	" _NU801_SDT_ADDR " 0\n"			\
+		"	.asciz \"nu801\"\n"				\
+		"	.asciz \"" #name "\"\n"				\
+		"	.asciz \"" args "\"\n"				\
+		"994:	.balign 4\n"					\
+		"	.popsection\n"					\
+		"	.ifndef _.stapsdt.base\n"			\
+		"	.pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+		"	.weak _.stapsdt.base\n"				\
+		"	.hidden _.stapsdt.base\n"			\
+		"_.stapsdt.base: .space 1\n"				\
+		"	.size _.stapsdt.base, 1\n"			\
+		"	.popsection\n"					\
+		"	.endif\n"					\
+		:: __VA_ARGS__)
+
+#define NU801_PROBE0(name)						\
+	_NU801_SDT(name, "")
+#define NU801_PROBE1(name, a)						\
+	_NU801_SDT(name, _NU801_SDT_ARG(0),				\
+		   [a0] "nor" ((unsigned long)(a)))
+#define NU801_PROBE2(name, a, b)					\
+	_NU801_SDT(name, _NU801_SDT_ARG(0) " " _NU801_SDT_ARG(1),	\
+		   [a0] "nor" ((unsigned long)(a)),			\
+		   [a1] "nor" ((unsigned long)(b)))
+
+#endif /* NU801_NO_PROBES */
+
+#endif /* _PROBES_H_ */
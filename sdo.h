@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Reading the NU801's register back through its cascade output (SDO),
+ * the same way for the daemon (-V) and nu801-calibrate.
+ *
+ * SDO is sampled right before each rising CKI edge. With an offset of 0,
+ * the sample before the k-th edge of a pass is bit k of what the pass
+ * before it shifted in. Depending on the wiring (i.e. an input with a
+ * synchronizer), it can be a bit early (+1) or late (-1) as well, which
+ * nu801-calibrate finds out. The bits that get cut off at either end of
+ * a pass aren't compared.
+ */
+#ifndef _SDO_H_
+#define _SDO_H_
+
+#include <stdint.h>
+
+#define SDO_OFFSET_MIN		-1
+#define SDO_OFFSET_MAX		1
+
+/*
+ * the number of bits that didn't come back, seen[] are the samples of
+ * the pass that followed the one that shifted sent[] in. One bit per
+ * byte, both are bits long.
+ */
+static inline unsigned int sdo_mismatches(const uint8_t *sent,
+					  const uint8_t *seen,
+					  unsigned int bits, int offset)
+{
+	unsigned int k, errors = 0;
+
+	for (k = 0; k < bits; k++) {
+		if ((int)k + offset < 0 || k + offset >= bits)
+			continue;
+
+		errors += seen[k] != sent[k + offset];
+	}
+
+	return errors;
+}
+
+#endif /* _SDO_H_ */
@@ -0,0 +1,90 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Runs the daemon's shift_frame() on a board without the hardware.
+ *
+ * The daemon is built in here with its main() renamed and the GPIO
+ * calls it makes stubbed out, so the lines only end up in the trace.
+ * A few frames are shifted and latched and the trace is written to a
+ * file that nu801-trace2vcd checks against its model of the chip:
+ *
+ *	nu801-selftest cisco-mx100-hw nu801.trace && \
+ *	    nu801-trace2vcd nu801.trace /dev/null
+ */
+
+#define main nu801_main
+#include "nu801.c"
+#undef main
+
+static unsigned long commits;
+
+int gpiotools_request_line(const char *device_name, unsigned int *lines,
+			   unsigned int num_lines,
+			   struct gpio_v2_line_config *config,
+			   const char *consumer)
+{
+	return -ENODEV;
+}
+
+int gpiotools_set_values(const int fd, struct gpio_v2_line_values *values)
+{
+	commits++;
+	return 0;
+}
+
+int gpiotools_get_values(const int fd, struct gpio_v2_line_values *values)
+{
+	return 0;
+}
+
+int gpiotools_release_line(const int fd)
+{
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static const uint16_t frames[][3] = {
+		{ 0x8001, 0x1234, 0xffff },
+		{ 0x0000, 0xa5a5, 0x5a5a },
+		{ 0x7fff, 0x0001, 0x8000 },
+		{ 0x0000, 0x0000, 0x0000 },
+	};
+	unsigned int f;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: nu801-selftest device-id dump\n");
+		return EXIT_FAILURE;
+	}
+
+	for (dev = &supported_hardware[0]; dev->id; dev++) {
+		if (!strcmp(argv[1], dev->id))
+			break;
+	}
+
+	if (!dev->id) {
+		fprintf(stderr, "nu801-selftest: unsupported device '%s'\n",
+			argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	num_channels = ARRAY_SIZE(frames[0]);
+	gpiotools_set_bit(&values.mask, NU801_CKI);
+	gpiotools_set_bit(&values.mask, NU801_SDI);
+	if (~0 ^ dev->gpio.num.lei)
+		gpiotools_set_bit(&values.mask, NU801_LEI);
+
+	trace.enabled = true;
+	for (f = 0; f < ARRAY_SIZE(frames); f++) {
+		shift_frame(dev, frames[f], NULL, true);
+		/* let the pseudo latch expire, the chip model wants 600us */
+		usleep(1000);
+	}
+	gpio_idle(dev);
+
+	printf("%s: %lu GPIO commits for %u frames\n", dev->id, commits, f);
+	/* nu801-trace2vcd has nothing to complain about in an empty trace */
+	if (!commits)
+		return EXIT_FAILURE;
+
+	return trace_write(argv[2]) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
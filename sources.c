@@ -0,0 +1,512 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Native activity sources for the NU801 userspace controller.
+ *
+ * The proc files are read with pread() at offset 0 into a static buffer
+ * and parsed in place. This is cheap enough to be done several times a
+ * second, even on the MR18's MIPS.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include "sources.h"
+
+static char buf[16384];
+
+/* reads a whole proc file from the start, returns its length or -errno */
+static ssize_t read_proc(int fd)
+{
+	ssize_t len;
+
+	len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len < 0)
+		return -errno;
+
+	buf[len] = '\0';
+	return len;
+}
+
+/* skips blanks and parses a decimal number, no locale, no errno */
+static const char *parse_u64(const char *s, uint64_t *val)
+{
+	uint64_t v = 0;
+
+	while (*s == ' ' || *s == '\t')
+		s++;
+
+	while (*s >= '0' && *s <= '9')
+		v = v * 10 + (*s++ - '0');
+
+	*val = v;
+	return s;
+}
+
+/* Q16 of delta / (max * dt) with dt in ns, saturated at 1.0 */
+static uint32_t rate_load(uint64_t delta, uint64_t max, uint64_t dt)
+{
+	uint64_t full = max * dt / 1000000000ULL;
+
+	if (!full)
+		return 0;
+	if (delta >= full)
+		return 65536;
+
+	return (delta << 16) / full;
+}
+
+/**
+ * gauge_color() - color ramp for the load of a source
+ * @load:		Q16 load (0 - 65536).
+ * @rgb:		The resulting 16-bit red, green, blue.
+ *
+ * Goes from a dim green when idle through green and yellow to red.
+ */
+void gauge_color(uint32_t load, uint16_t *rgb)
+{
+	if (load > 65536)
+		load = 65536;
+
+	if (load < 16384) {
+		/* dim -> full green */
+		rgb[0] = 0;
+		rgb[1] = 16384 + load * 3;
+	} else if (load < 40960) {
+		/* green -> yellow */
+		rgb[0] = (load - 16384) * 65535 / 24576;
+		rgb[1] = 65535;
+	} else {
+		/* yellow -> red */
+		rgb[0] = 65535;
+		rgb[1] = (65536 - load) * 65535 / 24576;
+	}
+	rgb[2] = 0;
+}
+
+static int netdev_request_link(struct netdev_source *net)
+{
+	struct {
+		struct nlmsghdr nh;
+		struct ifinfomsg ifi;
+	} req = {
+		.nh = {
+			.nlmsg_len = sizeof(req),
+			.nlmsg_type = RTM_GETLINK,
+			.nlmsg_flags = NLM_F_REQUEST,
+		},
+		.ifi = {
+			.ifi_family = AF_UNSPEC,
+			.ifi_index = net->ifindex,
+		},
+	};
+
+	if (send(net->nl_fd, &req, sizeof(req), 0) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/**
+ * netdev_open() - set up the sampling of a network interface
+ * @net:		The source.
+ * @ifname:		The interface.
+ * @max_rate:		The rate in bytes per second that is full scale.
+ *
+ * Return:		On success return 0;
+ *			On failure return the errno.
+ */
+int netdev_open(struct netdev_source *net, const char *ifname,
+		uint64_t max_rate)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = RTMGRP_LINK,
+	};
+	int ret;
+
+	memset(net, 0, sizeof(*net));
+	net->proc_fd = -1;
+	net->nl_fd = -1;
+
+	if (strlen(ifname) >= sizeof(net->ifname))
+		return -ENAMETOOLONG;
+	strcpy(net->ifname, ifname);
+	net->max_rate = max_rate;
+
+	/* the interface might come later, the link events will tell. */
+	net->ifindex = if_nametoindex(ifname);
+
+	net->proc_fd = open("/proc/net/dev", O_RDONLY | O_CLOEXEC);
+	if (net->proc_fd < 0)
+		return -errno;
+
+	net->nl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			    NETLINK_ROUTE);
+	if (net->nl_fd < 0) {
+		ret = -errno;
+		goto err;
+	}
+
+	if (bind(net->nl_fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		ret = -errno;
+		goto err;
+	}
+
+	/* the answer is handled just like any link event */
+	if (net->ifindex) {
+		ret = netdev_request_link(net);
+		if (ret)
+			goto err;
+	}
+
+	return 0;
+
+err:
+	netdev_close(net);
+	return ret;
+}
+
+void netdev_close(struct netdev_source *net)
+{
+	if (net->proc_fd >= 0)
+		close(net->proc_fd);
+	if (net->nl_fd >= 0)
+		close(net->nl_fd);
+
+	net->proc_fd = -1;
+	net->nl_fd = -1;
+}
+
+/**
+ * netdev_sample() - read the interface's counters
+ * @net:		The source.
+ * @now:		CLOCK_MONOTONIC in ns.
+ *
+ * The load is the higher of the rx and tx rate, relative to max_rate.
+ *
+ * Return:		On success return 0;
+ *			On failure return the errno.
+ */
+int netdev_sample(struct netdev_source *net, uint64_t now)
+{
+	uint64_t rx, tx, drx, dtx, skip, dt;
+	size_t len = strlen(net->ifname);
+	const char *line, *s;
+	unsigned int i;
+	ssize_t ret;
+
+	ret = read_proc(net->proc_fd);
+	if (ret < 0)
+		return ret;
+
+	/* "  eth0: rx_bytes packets errs drop fifo frame compressed multicast tx_bytes ..." */
+	for (line = buf; line; line = strchr(line, '\n')) {
+		line += strspn(line, "\n ");
+		if (!strncmp(line, net->ifname, len) && line[len] == ':')
+			break;
+	}
+
+	if (!line) {
+		net->primed = false;
+		net->load = 0;
+		return -ENODEV;
+	}
+
+	s = parse_u64(line + len + 1, &rx);
+	for (i = 0; i < 7; i++)
+		s = parse_u64(s, &skip);
+	parse_u64(s, &tx);
+
+	dt = now - net->last;
+	/*
+	 * the counters go backwards if the interface was recreated (or a
+	 * 32-bit one wrapped), that sample only starts over from them.
+	 */
+	if (net->primed && dt && rx >= net->rx_bytes && tx >= net->tx_bytes) {
+		drx = rx - net->rx_bytes;
+		dtx = tx - net->tx_bytes;
+		net->load = rate_load(drx > dtx ? drx : dtx, net->max_rate, dt);
+	}
+
+	net->rx_bytes = rx;
+	net->tx_bytes = tx;
+
+	net->last = now;
+	net->primed = true;
+	return 0;
+}
+
+/**
+ * netdev_link_event() - process the pending rtnetlink messages
+ * @net:		The source.
+ *
+ * Return:		1 if the link state of the interface changed, 0 if
+ *			not or the errno.
+ */
+int netdev_link_event(struct netdev_source *net)
+{
+	char msg[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct nlmsghdr *nh;
+	struct ifinfomsg *ifi;
+	struct rtattr *rta;
+	const char *name;
+	bool up = net->up;
+	ssize_t len;
+	int alen;
+
+	for (;;) {
+		len = recv(net->nl_fd, msg, sizeof(msg), MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EAGAIN)
+				break;
+			/* ENOBUFS: we missed some, ask again */
+			if (errno == ENOBUFS && net->ifindex)
+				return netdev_request_link(net);
+			return -errno;
+		}
+
+		for (nh = (struct nlmsghdr *)msg; NLMSG_OK(nh, len);
+		     nh = NLMSG_NEXT(nh, len)) {
+			if (nh->nlmsg_type != RTM_NEWLINK &&
+			    nh->nlmsg_type != RTM_DELLINK)
+				continue;
+
+			ifi = NLMSG_DATA(nh);
+
+			/* match by name, the interface may get recreated */
+			name = NULL;
+			alen = IFLA_PAYLOAD(nh);
+			for (rta = IFLA_RTA(ifi); RTA_OK(rta, alen);
+			     rta = RTA_NEXT(rta, alen)) {
+				if (rta->rta_type == IFLA_IFNAME)
+					name = RTA_DATA(rta);
+			}
+
+			if (!name || strcmp(name, net->ifname))
+				continue;
+
+			net->ifindex = ifi->ifi_index;
+			up = nh->nlmsg_type == RTM_NEWLINK &&
+			     (ifi->ifi_flags & IFF_RUNNING);
+		}
+	}
+
+	if (up == net->up)
+		return 0;
+
+	net->up = up;
+	return 1;
+}
+
+/* red if the link is down, otherwise the utilization ramp */
+void netdev_color(const struct netdev_source *net, uint16_t *rgb)
+{
+	if (!net->up) {
+		rgb[0] = 65535;
+		rgb[1] = rgb[2] = 0;
+		return;
+	}
+
+	gauge_color(net->load, rgb);
+}
+
+int cpu_open(struct cpu_source *cpu)
+{
+	memset(cpu, 0, sizeof(*cpu));
+
+	cpu->proc_fd = open("/proc/stat", O_RDONLY | O_CLOEXEC);
+	if (cpu->proc_fd < 0)
+		return -errno;
+
+	return 0;
+}
+
+void cpu_close(struct cpu_source *cpu)
+{
+	if (cpu->proc_fd >= 0)
+		close(cpu->proc_fd);
+	cpu->proc_fd = -1;
+}
+
+/**
+ * cpu_sample() - read the CPU times
+ * @cpu:		The source.
+ *
+ * The load is the share of the time all CPUs were neither idle nor
+ * waiting for I/O since the last sample.
+ *
+ * Return:		On success return 0;
+ *			On failure return the errno.
+ */
+int cpu_sample(struct cpu_source *cpu)
+{
+	uint64_t val, busy = 0, total = 0;
+	const char *s;
+	unsigned int i;
+	ssize_t ret;
+
+	/* the aggregate is the first line, only read what's needed */
+	ret = pread(cpu->proc_fd, buf, 256, 0);
+	if (ret < 0)
+		return -errno;
+	buf[ret] = '\0';
+
+	/* "cpu  user nice system idle iowait irq softirq steal ..." */
+	if (strncmp(buf, "cpu ", 4))
+		return -EINVAL;
+
+	for (i = 0, s = buf + 4; i < 8; i++) {
+		s = parse_u64(s, &val);
+		total += val;
+		if (i != 3 && i != 4)
+			busy += val;
+	}
+
+	if (cpu->primed && total > cpu->total) {
+		val = busy - cpu->busy;
+		cpu->load = (val << 16) / (total - cpu->total);
+	}
+
+	cpu->busy = busy;
+	cpu->total = total;
+	cpu->primed = true;
+	return 0;
+}
+
+int disk_open(struct disk_source *disk, const char *name)
+{
+	memset(disk, 0, sizeof(*disk));
+
+	if (strlen(name) >= sizeof(disk->name))
+		return -ENAMETOOLONG;
+	strcpy(disk->name, name);
+
+	disk->proc_fd = open("/proc/diskstats", O_RDONLY | O_CLOEXEC);
+	if (disk->proc_fd < 0)
+		return -errno;
+
+	return 0;
+}
+
+void disk_close(struct disk_source *disk)
+{
+	if (disk->proc_fd >= 0)
+		close(disk->proc_fd);
+	disk->proc_fd = -1;
+}
+
+/**
+ * disk_sample() - read the disk's I/O time
+ * @disk:		The source.
+ * @now:		CLOCK_MONOTONIC in ns.
+ *
+ * The load is the share of the time the disk had I/O in flight.
+ *
+ * Return:		On success return 0;
+ *			On failure return the errno.
+ */
+int disk_sample(struct disk_source *disk, uint64_t now)
+{
+	size_t len = strlen(disk->name);
+	uint64_t val, dt;
+	const char *line, *s;
+	unsigned int i;
+	ssize_t ret;
+
+	ret = read_proc(disk->proc_fd);
+	if (ret < 0)
+		return ret;
+
+	/* " major minor name reads ... io_ticks(ms) ..." io_ticks is #10 */
+	for (line = buf; line; line = strchr(line, '\n')) {
+		line += strspn(line, "\n");
+		s = parse_u64(line, &val);
+		s = parse_u64(s, &val);
+		s += strspn(s, " ");
+		if (!strncmp(s, disk->name, len) && s[len] == ' ')
+			break;
+	}
+
+	if (!line) {
+		disk->primed = false;
+		disk->load = 0;
+		return -ENODEV;
+	}
+
+	for (i = 0, s += len; i < 10; i++)
+		s = parse_u64(s, &val);
+
+	dt = (now - disk->last) / 1000000ULL;
+	if (disk->primed && dt && val >= disk->io_ms)
+		disk->load = rate_load(val - disk->io_ms, 1000, dt * 1000000ULL);
+
+	disk->io_ms = val;
+	disk->last = now;
+	disk->primed = true;
+	return 0;
+}
+
+/**
+ * thermal_open() - open a thermal zone
+ * @thermal:		The source.
+ * @zone:		The zone's number in /sys/class/thermal or a path
+ *			to a file with the temperature in m°C.
+ *
+ * Return:		On success return 0;
+ *			On failure return the errno.
+ */
+int thermal_open(struct thermal_source *thermal, const char *zone)
+{
+	char path[64];
+	char *end;
+
+	memset(thermal, 0, sizeof(*thermal));
+
+	strtoul(zone, &end, 10);
+	if (*zone && !*end) {
+		snprintf(path, sizeof(path),
+			 "/sys/class/thermal/thermal_zone%s/temp", zone);
+		zone = path;
+	}
+
+	thermal->fd = open(zone, O_RDONLY | O_CLOEXEC);
+	if (thermal->fd < 0)
+		return -errno;
+
+	return thermal_sample(thermal);
+}
+
+void thermal_close(struct thermal_source *thermal)
+{
+	if (thermal->fd >= 0)
+		close(thermal->fd);
+	thermal->fd = -1;
+}
+
+int thermal_sample(struct thermal_source *thermal)
+{
+	const char *s;
+	uint64_t val;
+	ssize_t ret;
+	bool neg;
+
+	ret = pread(thermal->fd, buf, 31, 0);
+	if (ret < 0)
+		return -errno;
+	buf[ret] = '\0';
+
+	/* "45000\n", a stand-in file might lack the newline */
+	neg = buf[0] == '-';
+	s = parse_u64(buf + neg, &val);
+	if (s == buf + neg || (*s && *s != '\n'))
+		return -EINVAL;
+
+	thermal->temp = neg ? -(int)val : (int)val;
+	return 0;
+}
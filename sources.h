@@ -0,0 +1,77 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Native activity sources for the NU801 userspace controller.
+ *
+ * Instead of having triggers or scripts write the LEDs all the time,
+ * the daemon samples the counters itself at a fixed rate and maps them
+ * onto a color. Everything works on preopened fds and static buffers,
+ * there are no allocations once a source is open.
+ */
+#ifndef _SOURCES_H_
+#define _SOURCES_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <net/if.h>
+
+/* Q16 (65536 = 1.0) load -> 16-bit red, green, blue */
+void gauge_color(uint32_t load, uint16_t *rgb);
+
+struct netdev_source {
+	char ifname[IF_NAMESIZE];
+	unsigned int ifindex;
+	uint64_t max_rate;	/* bytes per second at full scale */
+
+	int proc_fd;		/* /proc/net/dev */
+	int nl_fd;		/* rtnetlink, link up/down */
+
+	uint64_t rx_bytes, tx_bytes, last;
+	bool up, primed;
+	uint32_t load;		/* Q16 utilization */
+};
+
+int netdev_open(struct netdev_source *net, const char *ifname,
+		uint64_t max_rate);
+void netdev_close(struct netdev_source *net);
+int netdev_sample(struct netdev_source *net, uint64_t now);
+int netdev_link_event(struct netdev_source *net);
+void netdev_color(const struct netdev_source *net, uint16_t *rgb);
+
+/* busy time of all CPUs from /proc/stat */
+struct cpu_source {
+	int proc_fd;
+
+	uint64_t busy, total;
+	bool primed;
+	uint32_t load;
+};
+
+int cpu_open(struct cpu_source *cpu);
+void cpu_close(struct cpu_source *cpu);
+int cpu_sample(struct cpu_source *cpu);
+
+/* time a disk was busy with I/O from /proc/diskstats */
+struct disk_source {
+	char name[32];
+	int proc_fd;
+
+	uint64_t io_ms, last;
+	bool primed;
+	uint32_t load;
+};
+
+int disk_open(struct disk_source *disk, const char *name);
+void disk_close(struct disk_source *disk);
+int disk_sample(struct disk_source *disk, uint64_t now);
+
+/* a thermal zone's (or any other file's) temperature in millidegrees */
+struct thermal_source {
+	int fd;
+	int temp;		/* m°C */
+};
+
+int thermal_open(struct thermal_source *thermal, const char *zone);
+void thermal_close(struct thermal_source *thermal);
+int thermal_sample(struct thermal_source *thermal);
+
+#endif /* _SOURCES_H_ */
@@ -0,0 +1,88 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Binary trace of what the daemon does on the wires, the dump.
+ * See trace.h for the format.
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <endian.h>
+#include "trace.h"
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		buf = (const char *)buf + ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/**
+ * trace_dump() - write the ring to a file
+ * @ring:		The ring.
+ * @path:		The file, it gets replaced.
+ * @names:		The LEDs' names, for the events.
+ * @num_names:		The number of names.
+ *
+ * The records are converted to little-endian in chunks, so a dump
+ * from a big-endian MIPS box can be read anywhere.
+ *
+ * Return:		On success return 0;
+ *			On failure return the errno.
+ */
+int trace_dump(const struct trace_ring *ring, const char *path,
+	       const char *const *names, unsigned int num_names)
+{
+	struct trace_header hdr = { .magic = TRACE_MAGIC };
+	struct trace_record chunk[256];
+	char name[TRACE_NAME_SIZE];
+	uint64_t first, pos;
+	unsigned int i, n;
+	int fd, ret;
+
+	first = ring->head > TRACE_RECORDS ? ring->head - TRACE_RECORDS : 0;
+	hdr.version = TRACE_VERSION;
+	hdr.leds = num_names;
+	hdr.records = htole32(ring->head - first);
+	hdr.lost = htole32(first);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	ret = write_all(fd, &hdr, sizeof(hdr));
+
+	for (i = 0; !ret && i < num_names; i++) {
+		strncpy(name, names[i], sizeof(name) - 1);
+		name[sizeof(name) - 1] = '\0';
+		ret = write_all(fd, name, sizeof(name));
+	}
+
+	for (pos = first; !ret && pos < ring->head; pos += n) {
+		for (n = 0; n < 256 && pos + n < ring->head; n++) {
+			chunk[n] = ring->records[(pos + n) & (TRACE_RECORDS - 1)];
+			chunk[n].ns = htole64(chunk[n].ns);
+			chunk[n].value = htole32(chunk[n].value);
+		}
+
+		ret = write_all(fd, chunk, n * sizeof(chunk[0]));
+	}
+
+	if (close(fd) && !ret)
+		ret = -errno;
+
+	return ret;
+}
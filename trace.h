@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Binary trace of what the daemon does on the wires.
+ *
+ * Every GPIO commit and uleds event is recorded into a fixed ring in
+ * memory, the oldest records get overwritten. Adding one is a store of
+ * 16 bytes, so tracing can stay on in the field and the ring is dumped
+ * once something looks wrong. nu801-trace2vcd turns a dump into a VCD.
+ *
+ * Dump format (all little-endian):
+ *
+ *	offset	size	field
+ *	0	4	magic "NUTR"
+ *	4	1	version (1)
+ *	5	1	number of LEDs
+ *	6	2	reserved
+ *	8	4	number of records
+ *	12	4	records that were lost to the ring wrapping around
+ *	16	32 * n	the LEDs' names, NUL padded
+ *	...	16 * n	the records, oldest first
+ *
+ * A GPIO record holds the line values (bit 0: CKI, 1: SDI, 2: LEI) once
+ * the commit has returned, an event record the LED and its brightness.
+ * Before a frame is shifted in to be latched, there's a frame record
+ * with the PWM value for each channel (as the LED field).
+ */
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TRACE_MAGIC		"NUTR"
+#define TRACE_VERSION		1
+#define TRACE_RECORDS		8192	/* a power of 2, ~80 frames */
+#define TRACE_NAME_SIZE		32
+
+enum trace_type {
+	TRACE_GPIO = 0,
+	TRACE_EVENT,
+	TRACE_FRAME,
+};
+
+struct trace_header {
+	char magic[4];
+	uint8_t version;
+	uint8_t leds;
+	uint16_t reserved;
+	uint32_t records;
+	uint32_t lost;
+} __attribute__((packed));
+
+struct trace_record {
+	uint64_t ns;		/* CLOCK_MONOTONIC */
+	uint8_t type;
+	uint8_t led;		/* TRACE_EVENT, channel for TRACE_FRAME */
+	uint16_t reserved;
+	uint32_t value;		/* line values, brightness or PWM */
+} __attribute__((packed));
+
+struct trace_ring {
+	bool enabled;
+	uint64_t head;		/* records ever added */
+	struct trace_record records[TRACE_RECORDS];
+};
+
+static inline void trace_add(struct trace_ring *ring, uint64_t ns,
+			     enum trace_type type, unsigned int led,
+			     uint32_t value)
+{
+	struct trace_record *r;
+
+	r = &ring->records[ring->head++ & (TRACE_RECORDS - 1)];
+	r->ns = ns;
+	r->type = type;
+	r->led = led;
+	r->value = value;
+}
+
+int trace_dump(const struct trace_ring *ring, const char *path,
+	       const char *const *names, unsigned int num_names);
+
+#endif /* _TRACE_H_ */
@@ -0,0 +1,284 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Converts a trace dump of the NU801 userspace controller into a VCD
+ * (i.e. for GTKWave). The lines are shown as wires, the LEDs' events as
+ * integers with the brightness that was written.
+ *
+ * It also plays the part of the chip: a model of the NU801 shifts SDI in
+ * on the rising CKI edges and latches on LEI or after 600us of CKI high,
+ * like the datasheet says. The latched values are shown as well and each
+ * latch is checked against the frame that was sent. So is the edge
+ * order: SDI must not change in the same ioctl that raises CKI.
+ *
+ * gcc -D_GNU_SOURCE -Os -o nu801-trace2vcd -std=gnu11 trace2vcd.c
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include "trace.h"
+
+#define CKI		(1 << 0)
+#define SDI		(1 << 1)
+#define LEI		(1 << 2)
+
+#define CHANNELS	3
+#define PSEUDO_LATCH_NS	600000ULL
+
+/* the identifiers of the lines, the latched channels and then the LEDs */
+#define IDENT_PWM	3
+#define IDENT_LEDS	(IDENT_PWM + CHANNELS)
+
+static const char *const lines[] = { "cki", "sdi", "lei" };
+
+struct chip {
+	uint64_t reg;		/* the shift register, the last bit in bit 0 */
+	uint64_t rise;		/* when CKI went high */
+	uint64_t sdi;		/* when SDI changed */
+	uint64_t min_setup;	/* SDI before a rising CKI edge */
+	bool pseudo_latched;	/* in this CKI high phase */
+
+	uint16_t sent[CHANNELS]; /* the frame record */
+	unsigned int channels;
+	unsigned int shifted;	/* clocks since the frame record */
+
+	unsigned int latches, checked, mismatches, races;
+};
+
+/* VCD identifiers are printable characters, from '!' to '~' */
+static char ident(unsigned int i)
+{
+	return '!' + i;
+}
+
+static uint64_t start, last = ~0ULL;
+
+static void timestamp(FILE *out, uint64_t now)
+{
+	if (now != last)
+		fprintf(out, "#%llu\n", (unsigned long long)(now - start));
+	last = now;
+}
+
+static void value(FILE *out, uint32_t v, unsigned int width, unsigned int id)
+{
+	fprintf(out, "b");
+	while (width--)
+		fputc('0' + ((v >> width) & 1), out);
+	fprintf(out, " %c\n", ident(id));
+}
+
+static void latch(struct chip *chip, FILE *out, uint64_t now)
+{
+	unsigned int c, n = chip->channels ? chip->channels : CHANNELS;
+	uint16_t pwm;
+	bool wrong = false;
+
+	timestamp(out, now);
+	chip->latches++;
+
+	for (c = 0; c < n; c++) {
+		pwm = chip->reg >> (16 * (n - 1 - c));
+		value(out, pwm, 16, IDENT_PWM + c);
+		wrong |= chip->channels && pwm != chip->sent[c];
+	}
+
+	/* without a whole frame since the record, there's nothing to say */
+	if (!chip->channels || chip->shifted < 16 * n)
+		return;
+
+	chip->checked++;
+	if (wrong) {
+		chip->mismatches++;
+		fprintf(stderr, "nu801-trace2vcd: latched the wrong frame at %llu ns\n",
+			(unsigned long long)(now - start));
+	}
+}
+
+/* the pseudo latch happens without a record, once CKI was high for long */
+static void pseudo_latch(struct chip *chip, FILE *out, uint32_t bits,
+			 uint64_t now)
+{
+	if ((bits & CKI) && !chip->pseudo_latched &&
+	    now - chip->rise >= PSEUDO_LATCH_NS) {
+		chip->pseudo_latched = true;
+		latch(chip, out, chip->rise + PSEUDO_LATCH_NS);
+	}
+}
+
+static void gpio(struct chip *chip, FILE *out, uint32_t bits,
+		 uint32_t changed, uint64_t now)
+{
+	if ((changed & SDI) && (changed & CKI) && (bits & CKI))
+		chip->races++;
+
+	if ((changed & CKI) && (bits & CKI)) {
+		/* the chip gets the SDI from before, if it changed just now */
+		chip->reg = (chip->reg << 1) |
+			    !!((bits ^ (changed & SDI)) & SDI);
+		chip->shifted++;
+		if (!(changed & SDI) &&
+		    (!chip->min_setup || now - chip->sdi < chip->min_setup))
+			chip->min_setup = now - chip->sdi;
+
+		chip->rise = now;
+		chip->pseudo_latched = false;
+	}
+
+	if (changed & SDI)
+		chip->sdi = now;
+
+	if ((changed & LEI) && (bits & LEI))
+		latch(chip, out, now);
+}
+
+static int convert(FILE *in, FILE *out)
+{
+	char names[255][TRACE_NAME_SIZE];
+	struct trace_header hdr;
+	struct trace_record r;
+	struct chip chip = { 0 };
+	uint64_t now;
+	uint32_t bits = 0, changed, i, j;
+	bool primed = false;
+
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+	    memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != TRACE_VERSION ||
+	    IDENT_LEDS + hdr.leds > '~' - '!' + 1) {
+		fprintf(stderr, "nu801-trace2vcd: not a trace dump\n");
+		return -1;
+	}
+
+	if (fread(names, TRACE_NAME_SIZE, hdr.leds, in) != hdr.leds) {
+		fprintf(stderr, "nu801-trace2vcd: truncated dump\n");
+		return -1;
+	}
+
+	if (le32toh(hdr.lost))
+		fprintf(stderr, "nu801-trace2vcd: %u older records were lost\n",
+			le32toh(hdr.lost));
+
+	fprintf(out, "$timescale 1ns $end\n$scope module nu801 $end\n");
+	for (i = 0; i < sizeof(lines) / sizeof(lines[0]); i++)
+		fprintf(out, "$var wire 1 %c %s $end\n", ident(i), lines[i]);
+	for (i = 0; i < CHANNELS; i++)
+		fprintf(out, "$var reg 16 %c latched%u $end\n",
+			ident(IDENT_PWM + i), i);
+	for (i = 0; i < hdr.leds; i++) {
+		names[i][TRACE_NAME_SIZE - 1] = '\0';
+		for (j = 0; names[i][j]; j++) {
+			if (names[i][j] == ':' || names[i][j] == ' ')
+				names[i][j] = '_';
+		}
+
+		fprintf(out, "$var integer 32 %c %s $end\n",
+			ident(IDENT_LEDS + i), names[i]);
+	}
+	fprintf(out, "$upscope $end\n$enddefinitions $end\n");
+
+	for (i = 0; i < le32toh(hdr.records); i++) {
+		if (fread(&r, sizeof(r), 1, in) != 1) {
+			fprintf(stderr, "nu801-trace2vcd: truncated dump\n");
+			return -1;
+		}
+
+		now = le64toh(r.ns);
+		if (!i)
+			start = now;
+
+		pseudo_latch(&chip, out, bits, now);
+		timestamp(out, now);
+
+		switch (r.type) {
+		case TRACE_GPIO:
+			/* the first record sets all of them */
+			changed = primed ? bits ^ le32toh(r.value) : ~0U;
+
+			for (j = 0; j < sizeof(lines) / sizeof(lines[0]); j++) {
+				if ((changed >> j) & 1)
+					fprintf(out, "%u%c\n",
+						(le32toh(r.value) >> j) & 1,
+						ident(j));
+			}
+
+			/* the model needs to know where the lines were */
+			if (primed)
+				gpio(&chip, out, le32toh(r.value), changed, now);
+			else
+				chip.sdi = now;
+			primed = true;
+			bits = le32toh(r.value);
+			break;
+		case TRACE_EVENT:
+			if (r.led >= hdr.leds)
+				break;
+
+			value(out, le32toh(r.value), 32, IDENT_LEDS + r.led);
+			break;
+		case TRACE_FRAME:
+			if (r.led >= CHANNELS)
+				break;
+
+			if (!r.led) {
+				chip.channels = 0;
+				chip.shifted = 0;
+			}
+			chip.sent[r.led] = le32toh(r.value);
+			if (r.led >= chip.channels)
+				chip.channels = r.led + 1;
+			break;
+		}
+	}
+
+	/* a CKI that's still high latches, even if nothing was recorded */
+	pseudo_latch(&chip, out, bits, ~0ULL);
+
+	if (chip.races)
+		fprintf(stderr, "nu801-trace2vcd: SDI changed with a rising CKI %u times\n",
+			chip.races);
+
+	if (chip.latches)
+		fprintf(stderr, "nu801-trace2vcd: %u latches, %u of %u checked ones were wrong, SDI was set up %llu ns before CKI rose at least\n",
+			chip.latches, chip.mismatches, chip.checked,
+			(unsigned long long)chip.min_setup);
+
+	return chip.mismatches || chip.races ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	FILE *in, *out = stdout;
+	int ret;
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: nu801-trace2vcd dump [output.vcd]\n");
+		return EXIT_FAILURE;
+	}
+
+	in = fopen(argv[1], "rb");
+	if (!in) {
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	if (argc == 3) {
+		out = fopen(argv[2], "w");
+		if (!out) {
+			perror(argv[2]);
+			fclose(in);
+			return EXIT_FAILURE;
+		}
+	}
+
+	ret = convert(in, out);
+	fclose(in);
+	if (fclose(out) && !ret) {
+		perror("nu801-trace2vcd");
+		ret = -1;
+	}
+
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}